@@ -14,7 +14,9 @@ class Flo {
     height = h;
     data = new float[width*height*2];
   }
-  ~Flo(){};
+  ~Flo(){
+    delete [] data;
+  };
   
   void SetFlow(int u, int v, float fu, float fv){
     data[2*(u*width+v)] = fu;
@@ -28,6 +28,24 @@ class Flo;
 
 //------------------------------------------------------------------------------
 
+// Radius, in label steps, of the window re-expanded around the best label
+const int kBeamRadius = 2;
+
+//------------------------------------------------------------------------------
+
+// Dense discrete BP. The labels are stored once in a table shared by all the
+// nodes, which only hold the disbelief and foundation of each label.
+// With a beam width, each node only keeps its best labels. Those are updated
+// from the best labels of the neighbours, and periodically from the full
+// label set in a window around the current best.
+// Without beam, messages are computed with a vectorised min-sum kernel over
+// a precomputed table of the pairwise energy, indexed by the offset between
+// two labels when they lie on a regular grid, or by every pair of labels.
+// With several levels, message passing is first run on coarser grids where
+// each node covers a block of pixels and sums their unaries, and each level
+// initialises the foundations of the next finer one. The levels are kept in
+// memory, so multi-grid is turned off when the nodes have a memory budget.
+
 class GraphDiscrete : public GraphParticles{
   
 public:
@@ -36,6 +54,11 @@ public:
   
   // Initialisation
   virtual void InitialiseNode(View view, int x, int y);
+  virtual void InitialiseNodes(View view);
+  virtual Node CreateNode() const;
+  
+  // Multi-grid
+  void SolveCoarseLevel(View view, int width, int height);
   
   // Main node-wise operations
   virtual void Update(View view, int x, int y);
@@ -43,15 +66,44 @@ public:
   // Particle generation
   State GetFixedState(float dx, float dy);
   
+  // Pairwise tables
+  void BuildPairwiseTable();
+  
+  // Beam operations
+  bool IsBeam() const { return parameters.n_particles < labels.size(); }
+  void ProposeLabel(View view, int x, int y, int label);
+  int GetBestLabel(View view, int x, int y) const;
+  
   // Energy evaluation
   virtual float UnaryEnergy(View view, int x, int y, const State& state, float threshold) const;
   virtual float PairwiseEnergy(View view, int x1, int y1, const State& state1, int x2, int y2, const State& state2) const;
+  virtual float ParticleUnaryEnergy(View view, int x, int y, int k) const;
+  virtual void EvaluateMessages(View view, int from_x, int from_y, int to_x, int to_y, float* messages) const;
   
   // Displacement
   void GetDisplacement(float x, float y, const State& state, float& dx, float& dy) const;
   
-  // Import/export
+  // Import/export, the nodes having as many labels as this graph
   virtual char GetTag(){ return 'A'; }
+  virtual bool CanImportParticles(int n_particles) const { return n_particles == parameters.n_particles; }
+  
+protected:
+  // Discrete labels, shared by all the nodes, label_rows rows of label_side
+  StateVector labels;
+  int label_side;
+  int label_rows;
+  
+  // Pairwise energy between all pairs of labels, row-major
+  std::vector<float> pairwise_table;
+  
+  // Pairwise energy by label offset, (2*label_rows-1) rows of (2*label_side-1)
+  std::vector<float> offset_table;
+  
+  // Summed unaries of the coarse level being solved, empty at the finest level
+  std::vector<float> level_unaries;
+  
+  // Compact foundation of the last message source, decoded
+  mutable std::vector<float> decoded_foundation;
 };
 
 //------------------------------------------------------------------------------
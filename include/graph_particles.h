@@ -13,7 +13,12 @@
 
 #include "utils.h"
 #include "node.h"
+#include "node_field.h"
 #include "image_operator.h"
+#include "thread_pool.h"
+#include "image_buffer.h"
+#include "mapped_file.h"
+#include "instrumentation.h"
 #include <map>
 #include <set>
 
@@ -25,6 +30,9 @@ namespace pmbp{
   
 class Image;
 class Flo;
+class Visualizer;
+class Preprocessor;
+struct PreparedImage;
   
 //------------------------------------------------------------------------------
   
@@ -39,14 +47,25 @@ public:
   
   // Initialisation
   void InitialiseImages(Image* one, Image* two);
+  void InitialiseImages(const ImageBuffer& one, const ImageBuffer& two);
+  void InitialiseImages(const PreparedImage& one, const PreparedImage& two);
+  // Preprocesses on a pool shared with other graphs, which must outlive this
+  // one. Otherwise the graph creates a pool of parameters.n_threads threads.
+  void SetThreadPool(ThreadPool* pool);
   void InitialiseFields(View view);
   void InitialiseFields();
-  void InitialiseNodes(View view);
+  virtual void InitialiseNodes(View view);
   void InitialiseNodes();
   virtual void InitialiseNode(View view, int x, int y) = 0;
+  virtual Node CreateNode() const;
+  // Node with uniform foundations, in the storage given by the parameters
+  Node CreateInitialNode() const;
   
   // Main methods
   void Solve();
+  bool CanWarmStart() const;
+  void WarmStart(View view);
+  void AddVisualizer(Visualizer* visualizer);
   void Iterate(int it);
   void IterateView(int it, View view);
   void ResetProcessed();
@@ -61,10 +80,12 @@ public:
   // Energy evaluation
   virtual float UnaryEnergy(View view, int x, int y, const State& state, float threshold) const = 0;
   virtual float PairwiseEnergy(View view, int x1, int y1, const State& state1, int x2, int y2, const State& state2) const = 0;
+  virtual float ParticleUnaryEnergy(View view, int x, int y, int k) const;
     
   // Disbelief & state operation
   float EvaluateDisbelief(View view, int x, int y, const State& state, bool early_termination=false) const;
   float EvaluateMessage(View view, int from_x, int from_y, int to_x, int to_y, const State& state) const;
+  virtual void EvaluateMessages(View view, int from_x, int from_y, int to_x, int to_y, float* messages) const;
   State const * GetMinDisbeliefState(View view, int x, int y) const;
   float GetMaxDisbelief(View view, int x, int y) const;
   void UpdateCurrentDisbelief(View view, int x, int y);
@@ -76,19 +97,37 @@ public:
   virtual Image OutputMotionField(View view) const;
   virtual Image OutputReconstruction(View view) const;
   virtual Flo* ExportFlo(View view) const;
+  void ExportDisplacement(View view, float* buffer, int stride, int n_channels) const;
   Image OutputUnaryEnergy(View view, float& energy) const;
   Image OutputPairwiseEnergy(View view, float& energy) const;
   
-  // Import/export
+  // Average memory of a node of the view, storage included
+  float GetNodeBytes(View view) const;
+  
+  // Counters and timers of the last Solve, when built with
+  // PMBP_INSTRUMENTATION. Each Solve appends them to parameters.stats_file.
+  const Instrumentation& GetInstrumentation() const;
+  
+  // Import/export of the particles. A fields file has a versioned header
+  // (magic "PMBF", version, tag, state dimensions, number of particles,
+  // views, compression, rows per chunk), then for each view its size and
+  // chunks of rows. Each chunk holds its raw and stored sizes, the crc32 of
+  // the raw bytes, and the particles row by row, zlib compressed if asked.
+  // Files of the original unversioned layout can still be imported.
+  // Uncompressed files are memory mapped on import. Their rows are copied
+  // into the nodes when an iteration first reaches them, and the remaining
+  // ones when Solve returns.
   virtual void ImportFields(const std::string& filename);
   virtual void ExportFields(const std::string& filename);
+  virtual void ExportFields(std::ostream& fs);
   virtual char GetTag() = 0;
   
   // Utilities
   void GetDirections(int k, View view, int& i_first, int& i_last, int& j_first, int& j_last, int& i_incr, int& j_incr) const;
   
   // Debug
-  void Inspect();
+  std::string Describe(View view, int x, int y) const;
+  const Image* GetImage(View view) const;
   
 protected:
   // Number of dimensions of the state space (data and meta)
@@ -99,6 +138,38 @@ protected:
   Image* images[2];
   Image* gradients[2];
   Image* filtered[2];
+  void SetImages(Image* one, Image* two);
+  
+  // Fields files
+  bool ImportFieldsView(std::istream& fs, View view, int compression, int rows_per_chunk);
+  void ImportLegacyFields(std::istream& fs);
+  bool CheckFieldsHeader(char tag, int file_data_dim, int file_meta_dim, int n_particles);
+  // Whether nodes of n_particles particles can be imported
+  virtual bool CanImportParticles(int n_particles) const;
+  void ExportFieldsView(std::ostream& fs, View view, int compression, int rows_per_chunk) const;
+  void SetParticles(Node* node, const float* particles) const;
+  void GetParticles(const Node* node, float* particles) const;
+  
+  // Imported fields file, mapped until all its chunks are copied
+  MappedFile mapped_fields;
+  size_t mapped_offsets[2];
+  int mapped_rows_per_chunk;
+  std::vector<bool> mapped_chunks[2];
+  bool MapFieldsView(View view, int rows_per_chunk, size_t& offset);
+  void FaultInRows(View view, int y_first, int y_last);
+  void FaultInAll();
+  
+  // Displays of the motion field during Solve, not owned
+  std::vector<Visualizer*> visualizers;
+  void Visualise() const;
+  
+  // Images created from caller buffers, owned by the graph
+  Image* wrapped[2];
+  
+  // Threads of the preprocessing, owned unless shared, created on first use
+  ThreadPool* thread_pool;
+  bool owns_thread_pool;
+  Preprocessor* preprocessor;
   int w[2];
   int h[2];
   
@@ -110,8 +181,28 @@ protected:
   Mask processed[2];
   Mask propagated[2];
   
+  // Buffers of the node visits, kept from one node to the next
+  std::vector<float> visit_messages;
+  std::vector<float> visit_foundation;
+  std::vector<float> visit_message_sum;
+  
   // Parameters
   Parameters parameters;
+  
+  // Current iteration
+  int iteration;
+  
+  // Nodes of the previous pair, when the current one was warm started
+  NodeField previous_nodes[2];
+  bool warm_started;
+  void GetWarmStartState(View view, int x, int y, State& state) const;
+  
+  // Candidates tested against the patch lower bound, and rejected by it
+  mutable long bound_tests;
+  mutable long bound_rejections;
+  
+  // Per iteration and view statistics, dumped to parameters.stats_file
+  Instrumentation instrumentation;
 };
   
 //------------------------------------------------------------------------------
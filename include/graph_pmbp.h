@@ -27,10 +27,16 @@ public:
   virtual void Propagate(View view, int x, int y);
   virtual void Randomise(View view, int x, int y);
   
-  // Candidate state generation
-  virtual State GetRandomState(View view, int x, int y) const = 0;
-  virtual State GetRandomStateAround(View view, int x, int y, const State& current, float ratio) const = 0;
-  virtual State GetStateFromNeighbour(View view, int x, int y, int nx, int ny) const = 0;
+  // Candidate state generation, into a state whose storage is reused
+  virtual void GetRandomState(View view, int x, int y, State& state) const = 0;
+  virtual void GetRandomStateAround(View view, int x, int y, const State& current, float ratio, State& state) const = 0;
+  virtual void GetStateFromNeighbour(View view, int x, int y, int nx, int ny, State& state) const = 0;
+
+protected:
+  // Candidate being proposed. As the graph is solved on a single thread,
+  // one state holds every candidate in turn, which only allocates its data
+  // on the first one instead of for each candidate.
+  State candidate;
 };
 
 //------------------------------------------------------------------------------
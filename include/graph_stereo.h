@@ -24,10 +24,10 @@ public:
   virtual float PairwiseEnergy(View view, int x1, int y1, const State& state1, int x2, int y2, const State& state2) const;
   
   // Candidate state generation
-  State GetStateFromParametrization(float x, float y, float nx, float ny, float nz, float d) const;
-  virtual State GetRandomState(View view, int x, int y) const;
-  virtual State GetRandomStateAround(View view, int x, int y, const State& current, float ratio) const;
-  virtual State GetStateFromNeighbour(View view, int x, int y, int nx, int ny) const;
+  void GetStateFromParametrization(float x, float y, float nx, float ny, float nz, float d, State& state) const;
+  virtual void GetRandomState(View view, int x, int y, State& state) const;
+  virtual void GetRandomStateAround(View view, int x, int y, const State& current, float ratio, State& state) const;
+  virtual void GetStateFromNeighbour(View view, int x, int y, int nx, int ny, State& state) const;
   
   // Displacement
   void GetDisplacement(float x, float y, const State& state, float& dx, float& dy) const;
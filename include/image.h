@@ -10,13 +10,25 @@
 
 namespace pmbp{
   
+//------------------------------------------------------------------------------
+
+class ThreadPool;
+
 //------------------------------------------------------------------------------
   
 class Image{
  public:
   Image();
   Image(int w, int h);
+  // Views caller-owned pixels, which are neither copied nor freed
+  Image(int w, int h, int* pixels);
   ~Image();
+  
+  // Changes the dimensions, reallocating only to grow
+  void Resize(int w, int h);
+  
+  // Copies the pixels of another image, reusing the storage
+  void CopyFrom(const Image& other);
 
   Image* GetGradient();
 
@@ -30,7 +42,12 @@ class Image{
   void GetTransformedPixelCoordinate(float x, float y, float center_x, float center_y, float rotation, float scale, float& out_x, float& out_y) const;
   void GetInterpolatedPixel(float x, float y, float& r, float& g, float& b, bool disp=false) const;
   void GetHorizontallyInterpolatedPixel(float x, float y, float& r, float& g, float& b, bool disp=false) const;
-  Image* MedianFilter(int s);
+  // Median filter of size s, the row bands being spread over the pool
+  Image* MedianFilter(int s, ThreadPool* pool);
+  
+  // Median of one planar channel over the rows [start_y, end_y), with a
+  // (2r+1)x(2r+1) window clipped to the image
+  static void MedianFilterBand(const unsigned char* in, unsigned char* out, int width, int height, int r, int start_y, int end_y);
 
   float GetRealGradientX(int x, int y) const;
   float GetRealGradientY(int x, int y) const;
@@ -43,6 +60,8 @@ class Image{
   
   // Pixel data
   int* data;
+  int capacity;
+  bool owned;
   
   // Static method to access channel data from an int
   static int EncodeColour(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
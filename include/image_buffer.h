@@ -0,0 +1,44 @@
+#ifndef fpmbp_image_buffer_h
+#define fpmbp_image_buffer_h
+
+//------------------------------------------------------------------------------
+
+namespace pmbp{
+  
+//------------------------------------------------------------------------------
+
+class Image;
+  
+//------------------------------------------------------------------------------
+
+// Byte order of the pixels of a caller-owned buffer
+enum PixelFormat { kPixelBGRA8, kPixelRGBA8, kPixelBGR8, kPixelRGB8, kPixelGrey8 };
+  
+//------------------------------------------------------------------------------
+
+// Caller-owned pixels, stride being the number of bytes between two rows
+struct ImageBuffer
+{
+  const unsigned char* data;
+  int width;
+  int height;
+  int stride;
+  PixelFormat format;
+};
+  
+//------------------------------------------------------------------------------
+
+// Returns an Image on the pixels of the buffer. When the buffer has the
+// layout of Image (4-byte aligned BGRA on a little endian host with rows
+// packed), the image views the buffer, which must then outlive it; the solver
+// never writes to its input images. Otherwise the pixels are converted into a
+// new image, the alpha channel being dropped.
+Image* WrapImageBuffer(const ImageBuffer& buffer);
+  
+//------------------------------------------------------------------------------
+  
+}
+
+//------------------------------------------------------------------------------
+
+#endif
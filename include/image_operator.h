@@ -4,6 +4,7 @@
 //------------------------------------------------------------------------------
 
 #include <functional>	
+#include <vector>
 #include "utils.h"
 
 //------------------------------------------------------------------------------
@@ -17,10 +18,76 @@ class GraphParticles;
 
 //------------------------------------------------------------------------------
 
+// Number of patch pixels accumulated between two early termination checks
+const int kSupportBlock = 8;
+
+//------------------------------------------------------------------------------
+
 typedef std::function<void(float, float, const State&, float&, float&)> DisplacementFunction;
   
 //------------------------------------------------------------------------------
 
+// Pixels of the patch around a target pixel, sorted by decreasing adaptive
+// support weight, along with the weights in raster order. Computed once per
+// target pixel and reused for all the candidates evaluated there.
+
+struct SupportOrder
+{
+  SupportOrder() : view(kOne), x(-1), y(-1) {}
+  
+  View view;
+  int x;
+  int y;
+  std::vector<int> xs;
+  std::vector<int> ys;
+  std::vector<float> weights;
+  std::vector<float> raster_weights;
+  float weight_sum;
+};
+
+//------------------------------------------------------------------------------
+
+// Summed area tables of the colour channels and gradient of an image, to get
+// the mean of any rectangle in constant time
+
+struct IntegralImage
+{
+  void Build(const Image* image, const Image* gradient);
+  
+  // Sum of channel c (red, green, blue, gradient) over [x0,x1]x[y0,y1]
+  double Sum(int c, int x0, int y0, int x1, int y1) const;
+  
+  int width;
+  int height;
+  std::vector<double> sums[4];
+};
+
+//------------------------------------------------------------------------------
+
+// Number of recently evaluated patches kept for incremental patch costs
+const int kPatchCacheSize = 16;
+
+//------------------------------------------------------------------------------
+
+// Unweighted pixel costs of a fully evaluated patch. The cost of a pixel only
+// depends on the pixel and the state, so they can be reused by the overlapping
+// patch of a neighbouring pixel evaluated with the same state.
+
+struct PatchCache
+{
+  PatchCache() : view(kOne), start_x(0), start_y(0), width(0), height(0) {}
+  
+  View view;
+  State state;
+  int start_x;
+  int start_y;
+  int width;
+  int height;
+  std::vector<float> costs;
+};
+
+//------------------------------------------------------------------------------
+
 // Performs image operations
 
 class ImageOperator
@@ -29,9 +96,21 @@ public:
   ImageOperator(Image** img, Image** grad, Image** filt, int* ww, int* hh, Parameters& params, DisplacementFunction displacement_function);
   virtual ~ImageOperator();
   
+  // To be called when the images change
+  void Reset();
+  
   // Patch comparison
   float PatchCost(View view, int x, int y, const State& state, float threshold) const;
+  float OrderedPatchCost(View view, int x, int y, const State& state, float threshold) const;
+  float IncrementalPatchCost(View view, int x, int y, const State& state, float threshold) const;
+  float RectifiedPatchCost(View view, int x, int y, float a, float b, float c, float threshold) const;
+  float PatchLowerBound(View view, int x, int y, const State& state) const;
   float PixelCost(View target, View source, float x_source, float y_source, float x_target, float y_target, float r_center, float g_center, float b_center) const;
+  float WeightedPixelCost(View target, View source, float x_source, float y_source, float x_target, float y_target, float w) const;
+  float SupportWeight(View target, float x_target, float y_target, float r_center, float g_center, float b_center) const;
+  
+  // Weight-ordered traversal of the patch
+  const SupportOrder& GetSupportOrder(View view, int x, int y) const;
   
   // State validity
   bool IsStateValid(View view, int x, int y, const State& state) const;
@@ -43,11 +122,23 @@ public:
   int* w;
   int* h;
   
+  // Integral images, only built when the lower bound is used
+  IntegralImage integrals[2];
+  
   // Displacement function object
   DisplacementFunction displacement_function;
   
   // Parameters
   Parameters& parameters;
+  
+private:
+  // Support order of the last target pixel
+  mutable SupportOrder support_order;
+  
+  // Ring buffer of the last fully evaluated patches
+  mutable std::vector<PatchCache> patch_cache;
+  mutable int patch_cache_next;
+  mutable std::vector<float> patch_costs;
 };
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,41 @@
+#ifndef IMAGE_READER_NATIVE_H
+#define IMAGE_READER_NATIVE_H
+
+//------------------------------------------------------------------------------
+
+#include "image_reader.h"
+#include <cstdio>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp{
+  
+//------------------------------------------------------------------------------
+
+class Image;
+  
+//------------------------------------------------------------------------------
+  
+// Reads PNG (through libpng) and binary PPM/PGM files, decoding each row
+// straight into the pixel layout of Image. Returns 0 for other formats, or
+// if the file cannot be decoded.
+  
+class ImageReaderNative : public ImageReader {
+ public:
+  ImageReaderNative();
+  ~ImageReaderNative();
+  
+  Image* load(const std::string& filename);
+  
+ private:
+  Image* LoadPng(FILE* file);
+  Image* LoadPnm(FILE* file, bool colour);
+};
+  
+//------------------------------------------------------------------------------
+  
+}
+
+//------------------------------------------------------------------------------
+
+#endif
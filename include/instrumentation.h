@@ -0,0 +1,118 @@
+#ifndef fpmbp_instrumentation_h
+#define fpmbp_instrumentation_h
+
+//------------------------------------------------------------------------------
+
+#include <deque>
+#include <chrono>
+#include <ostream>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Counters and phase timers of the solver, kept per iteration and view. They
+// are only compiled in when PMBP_INSTRUMENTATION is defined, the macros below
+// expanding to nothing otherwise. Counts go to the record begun on the calling
+// thread, so that the image operator counts without knowing the graph, and
+// graphs solved concurrently keep their counts apart.
+
+class Instrumentation{
+ public:
+  enum Counter{
+    kPatchCosts = 0,
+    kPixelCosts,
+    kEarlyTerminations,
+    kAcceptedCandidates,
+    kMessageEvaluations,
+    kNumCounters
+  };
+  
+  enum Phase{
+    kUpdateDisbelief = 0,
+    kPropagate,
+    kRandomise,
+    kCache,
+    kNumPhases
+  };
+  
+  struct Record{
+    Record(int iteration, int view);
+  
+    int iteration;
+    int view;
+    long counters[kNumCounters];
+    double seconds[kNumPhases];
+  };
+  
+  Instrumentation();
+  ~Instrumentation();
+  
+  // Starts a record, which the calling thread counts into until End
+  void Begin(int iteration, int view);
+  void End();
+  void Clear();
+  
+  // Clears the records for the next solve, counting the solves from 0
+  void NextSolve();
+  int GetSolve() const;
+  
+  // The records of the current solve, written as a single line of JSON so
+  // that the solves of a sequence can be appended to one file
+  const std::deque<Record>& GetRecords() const;
+  void WriteJson(std::ostream& os) const;
+  
+  static void Count(Counter counter, long n=1){
+    if(current){
+      current->counters[counter] += n;
+    }
+  }
+  
+  static void AddTime(Phase phase, double seconds){
+    if(current){
+      current->seconds[phase] += seconds;
+    }
+  }
+
+ private:
+  std::deque<Record> records;
+  int solve;
+  static thread_local Record* current;
+};
+
+//------------------------------------------------------------------------------
+
+// Adds the time until the end of the scope to a phase
+class ScopedPhaseTimer{
+ public:
+  ScopedPhaseTimer(Instrumentation::Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+  ~ScopedPhaseTimer(){
+    Instrumentation::AddTime(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+
+ private:
+  Instrumentation::Phase phase;
+  std::chrono::steady_clock::time_point start;
+};
+
+//------------------------------------------------------------------------------
+
+#ifdef PMBP_INSTRUMENTATION
+#define PMBP_COUNT(counter) pmbp::Instrumentation::Count(pmbp::Instrumentation::counter)
+#define PMBP_COUNT_N(counter, n) pmbp::Instrumentation::Count(pmbp::Instrumentation::counter, n)
+#define PMBP_TIME_PHASE(phase) pmbp::ScopedPhaseTimer phase_timer(pmbp::Instrumentation::phase)
+#else
+#define PMBP_COUNT(counter)
+#define PMBP_COUNT_N(counter, n)
+#define PMBP_TIME_PHASE(phase)
+#endif
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef fpmbp_mapped_file_h
+#define fpmbp_mapped_file_h
+
+//------------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Read-only view of a whole file. The file is memory mapped: pages are only
+// read from disk when first touched, and are shared with the other processes
+// mapping the same file. Without mmap (Windows), the file is read at once.
+
+class MappedFile{
+ public:
+  MappedFile();
+  ~MappedFile();
+  
+  bool Open(const std::string& filename);
+  void Close();
+  
+  bool IsOpen() const;
+  const char* Data() const;
+  size_t Size() const;
+  
+ private:
+  const char* data;
+  size_t size;
+  
+#ifdef _WIN32
+  std::vector<char> buffer;
+#endif
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -31,8 +31,13 @@ public:
   
   void Set(int k, float value);
   float GetValue(int k) const;
+  const float* GetData() const;
   void SetUniform();
   void Normalize();
+  size_t Size() const;
+  
+  // Bytes of the values
+  size_t Bytes() const;
   
   std::string Summary() const;
   
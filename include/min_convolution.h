@@ -0,0 +1,99 @@
+#ifndef fpmbp_min_convolution_h
+#define fpmbp_min_convolution_h
+
+//------------------------------------------------------------------------------
+
+#include <algorithm>
+#include "utils.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PMBP_SSE
+#include <xmmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Min-sum kernels used to compute dense discrete messages, where a message is
+// m(t) = min_s (pairwise(t, s) + foundation(s)) over contiguous arrays.
+
+//------------------------------------------------------------------------------
+
+// Returns min_i (a[i] + b[i])
+inline
+float MinSum(const float* a, const float* b, int n)
+{
+  float value = infinity;
+  int i = 0;
+  
+#ifdef PMBP_SSE
+  if(n >= 8){
+    // Two accumulators to hide the latency of the min
+    __m128 m0 = _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b));
+    __m128 m1 = _mm_add_ps(_mm_loadu_ps(a+4), _mm_loadu_ps(b+4));
+    
+    for(i=8; i+8<=n; i+=8){
+      m0 = _mm_min_ps(m0, _mm_add_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+      m1 = _mm_min_ps(m1, _mm_add_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+    }
+    
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_min_ps(m0, m1));
+    value = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+  }
+#endif
+  
+  for(; i<n; ++i){
+    value = std::min(value, a[i] + b[i]);
+  }
+  
+  return value;
+}
+
+//------------------------------------------------------------------------------
+
+// Computes the message for n_target labels from a row-major n_target x n_source
+// pairwise table and the n_source foundation values of the source node
+inline
+void MinConvolution(const float* table, const float* foundation, int n_target, int n_source, float* messages)
+{
+  for(int t=0; t<n_target; ++t){
+    messages[t] = MinSum(table + t*n_source, foundation, n_source);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+// Computes the message for labels on a grid of n_v rows of n_u labels, from a
+// table of the pairwise energy indexed by the offset (us-ut, vs-vt) between the
+// source and target labels, with 2*n_v-1 rows of 2*n_u-1 offsets
+inline
+void OffsetMinConvolution(const float* table, const float* foundation, int n_u, int n_v, float* messages)
+{
+  int table_side = 2*n_u-1;
+  
+  for(int vt=0; vt<n_v; ++vt){
+    for(int ut=0; ut<n_u; ++ut){
+      float value = infinity;
+      
+      // For each source row, the offsets are contiguous in the table
+      for(int vs=0; vs<n_v; ++vs){
+        const float* row = table + (vs-vt+n_v-1)*table_side + (n_u-1-ut);
+        value = std::min(value, MinSum(row, foundation + vs*n_u, n_u));
+      }
+      
+      messages[vt*n_u+ut] = value;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -7,6 +7,8 @@
 #include "message.h"
 #include "utils.h"
 #include <vector>
+#include <algorithm>
+#include <cstring>
 
 //------------------------------------------------------------------------------
 
@@ -14,131 +16,445 @@ namespace pmbp {
 
 //------------------------------------------------------------------------------
   
-typedef std::pair<State, float> WeightedState;
-  
-//------------------------------------------------------------------------------
+// Particles are kept in place, as their index is shared with the foundations.
+// An indexed max-heap on the disbelief values gives the worst particle in
+// constant time and a cached argmin gives the best one. Ties are broken by
+// particle index, so the lookups match a linear scan.
+// A node can also refer to a label table shared by the whole graph (discrete
+// case), in which case it only stores the disbelief of each label, or of a
+// subset of the labels given by their indices in the table (beam).
+// Foundations can be stored compactly, in 16-bit fixed point, see
+// UseCompactFoundations.
   
 class Node{
 public:
-  Node() {}
+  Node() : labels(0), min_idx(0), min_valid(false) {}
   // Constructor with number of particles
-  Node(int k) {
-    particles.resize(k);
-    foundations.resize(4);
+  Node(int k) : labels(0), min_idx(0), min_valid(false) {
+    states.resize(k);
+    Allocate(k);
+  }
+  // Constructor with a shared label table, which must outlive the node
+  Node(StateVector const* l) : labels(l), min_idx(0), min_valid(false) {
+    Allocate(labels->size());
+  }
+  // Constructor with a subset of k labels of a shared table
+  Node(StateVector const* l, int k) : labels(l), min_idx(0), min_valid(false) {
+    label_indices.resize(k);
+    for(int i=0; i<k; ++i){
+      label_indices[i] = i;
+    }
+    Allocate(k);
   }
   
   void SetParticle(int k, const State& state, float value){
-    particles[k].first = state;
-    particles[k].second = value;
+    // Labels of a shared table are fixed
+    if(!labels){
+      states[k] = state;
+    }
+    SetParticleValue(k, value);
+  }
+  
+  void SetLabel(int k, int label, float value){
+    label_indices[k] = label;
+    SetParticleValue(k, value);
+  }
+  
+  int GetLabel(int k) const{
+    return label_indices.empty() ? k : label_indices[k];
+  }
+  
+  // Position of a label in the node, -1 if the node does not hold it
+  int FindLabel(int label) const{
+    if(label_indices.empty()){
+      return label;
+    }
+    
+    for(int i=0; i<label_indices.size(); ++i){
+      if(label_indices[i] == label){
+        return i;
+      }
+    }
+    
+    return -1;
   }
 
   void SetParticleValue(int k, float value){
-    particles[k].second = value;
+    float previous = values[k];
+    values[k] = value;
+    
+    // Restore the heap order
+    if(value > previous){
+      SiftUp(heap_position[k]);
+    }else if(value < previous){
+      SiftDown(heap_position[k]);
+    }
+    
+    // Update the cached argmin, rescanned lazily if the minimum got worse
+    if(min_valid){
+      if(IsLower(k, min_idx)){
+        min_idx = k;
+      }else if(k == min_idx && value > previous){
+        min_valid = false;
+      }
+    }
   }
   
   State const* GetParticle(int k) const{
-    return &particles[k].first;
+    return labels ? &(*labels)[GetLabel(k)] : &states[k];
   }
 
   float GetDisbelief(int k) const{
-    return particles[k].second;
+    return values[k];
   }
 
+  // Stores each foundation as its lowest value and the others as 16-bit
+  // steps of range/65535 above it, saturated at range. With pairwise
+  // energies in [0,range], a value more than range above the lowest one
+  // never gives the minimum of a message, so only the step is lost.
+  void UseCompactFoundations(float range){
+    compact.assign(kCompactHeader + 4*Size(), 0);
+    float step = range > 0.f ? range/65535.f : 0.f;
+    memcpy(&compact[0], &step, sizeof(step));
+    std::vector<Message>().swap(foundations);
+  }
+  
   void InitialiseFoundation(){
+    if(!compact.empty()){
+      for(int d=kLeft; d<=kDown; ++d){
+        SetCompactBase(d, 0.f);
+      }
+      std::fill(compact.begin()+kCompactHeader, compact.end(), 0);
+      return;
+    }
+    
     for(int i=0; i<foundations.size(); ++i){
       foundations[i] = Message(this);
       foundations[i].SetUniform();
     }
   }
   
-  void SetFoundationValue(Direction direction, int k, float value){
-    foundations[direction].Set(k, value);
+  // Sets all the values of a foundation and normalises it
+  void SetFoundation(Direction direction, const float* foundation){
+    int n = Size();
+    
+    if(compact.empty()){
+      for(int k=0; k<n; ++k){
+        foundations[direction].Set(k, foundation[k]);
+      }
+      foundations[direction].Normalize();
+      return;
+    }
+    
+    // Same normalisation as Message, then relative to the lowest value
+    float sum = 0.f;
+    float lowest = foundation[0];
+    for(int k=0; k<n; ++k){
+      sum += foundation[k];
+      lowest = std::min(lowest, foundation[k]);
+    }
+    float rest = sum != 0.f ? sum/n : 0.f;
+    
+    SetCompactBase(direction, lowest-rest);
+    for(int k=0; k<n; ++k){
+      compact[kCompactHeader + direction*n + k] = Quantise(foundation[k]-lowest);
+    }
+  }
+  
+  // Copies the foundations of a node with the same labels and storage
+  void CopyFoundations(const Node& other){
+    if(!compact.empty()){
+      compact = other.compact;
+      return;
+    }
+    
+    for(int d=kLeft; d<=kDown; ++d){
+      for(int k=0; k<Size(); ++k){
+        foundations[d].Set(k, other.foundations[d].GetValue(k));
+      }
+    }
   }
   
   float GetFoundationValue(Direction direction, int k) const{
-    return foundations[direction].GetValue(k);
+    if(compact.empty()){
+      return foundations[direction].GetValue(k);
+    }
+    
+    return GetCompactBase(direction) + compact[kCompactHeader + direction*Size() + k]*GetCompactStep();
   }
   
-  Message& GetFoundation(Direction direction){
-    return foundations[direction];
+  // Values of a foundation, decoded into buffer (of Size() floats) if they
+  // are stored compactly
+  const float* GetFoundationData(Direction direction, float* buffer) const{
+    if(compact.empty()){
+      return foundations[direction].GetData();
+    }
+    
+    for(int k=0; k<Size(); ++k){
+      buffer[k] = GetFoundationValue(direction, k);
+    }
+    return buffer;
   }
   
-  void NormalizeFoundation(Direction direction){
-    foundations[direction].Normalize();
+  bool HasCompactFoundations() const{
+    return !compact.empty();
   }
- 
-  State const* GetMinValueParticle() const{
-    int idx = 0;
-    float min_value = particles[0].second;
+  
+  // Appends the node to buffer, for paging (see NodeField). The shared label
+  // table is kept as a pointer, so the bytes are only valid in this process.
+  void Pack(std::vector<char>& buffer) const{
+    int n_states = states.size();
+    PackValue(buffer, n_states);
+    for(int k=0; k<n_states; ++k){
+      PackVector(buffer, states[k].data);
+      PackVector(buffer, states[k].meta);
+    }
+    PackVector(buffer, values);
+    PackVector(buffer, label_indices);
     
-    for(int i=1; i<particles.size(); ++i){
-      if(particles[i].second<min_value){
-        min_value = particles[i].second;
-        idx = i;
+    int n_foundations = foundations.size();
+    PackValue(buffer, n_foundations);
+    for(int d=0; d<n_foundations; ++d){
+      int size = foundations[d].Size();
+      PackValue(buffer, size);
+      for(int k=0; k<size; ++k){
+        PackValue(buffer, foundations[d].GetValue(k));
       }
     }
     
-    return &particles[idx].first;
+    PackVector(buffer, compact);
+    PackVector(buffer, heap);
+    PackVector(buffer, heap_position);
+    PackValue(buffer, labels);
+    PackValue(buffer, min_idx);
+    PackValue(buffer, min_valid);
   }
   
-  int GetMaxValueParticleIdx() const{
-    int idx = 0;
-    float max_value = particles[0].second;
+  // Reads a node written by Pack and returns the end of its bytes
+  const char* Unpack(const char* data){
+    int n_states;
+    data = UnpackValue(data, n_states);
+    states.resize(n_states);
+    for(int k=0; k<n_states; ++k){
+      data = UnpackVector(data, states[k].data);
+      data = UnpackVector(data, states[k].meta);
+    }
+    data = UnpackVector(data, values);
+    data = UnpackVector(data, label_indices);
     
-    for(int i=1; i<particles.size(); ++i){
-      if(particles[i].second>max_value){
-        max_value = particles[i].second;
-        idx = i;
+    int n_foundations;
+    data = UnpackValue(data, n_foundations);
+    foundations.resize(n_foundations);
+    for(int d=0; d<n_foundations; ++d){
+      int size;
+      data = UnpackValue(data, size);
+      foundations[d] = size ? Message(this) : Message();
+      for(int k=0; k<size; ++k){
+        float value;
+        data = UnpackValue(data, value);
+        foundations[d].Set(k, value);
       }
     }
     
-    return idx;
+    data = UnpackVector(data, compact);
+    data = UnpackVector(data, heap);
+    data = UnpackVector(data, heap_position);
+    data = UnpackValue(data, labels);
+    data = UnpackValue(data, min_idx);
+    data = UnpackValue(data, min_valid);
+    return data;
   }
   
-  float GetMinValue() const{
-    float min_value = particles[0].second;
-    
-    for(int i=1; i<particles.size(); ++i){
-      if(particles[i].second<min_value){
-        min_value = particles[i].second;
-      }
+  // Bytes used by the node and the storage it owns
+  size_t Bytes() const{
+    size_t bytes = sizeof(Node);
+    bytes += states.capacity()*sizeof(State) + values.capacity()*sizeof(float);
+    bytes += (label_indices.capacity() + heap.capacity() + heap_position.capacity())*sizeof(int);
+    bytes += foundations.capacity()*sizeof(Message) + compact.capacity()*sizeof(unsigned short);
+    for(int i=0; i<states.size(); ++i){
+      bytes += (states[i].data.capacity() + states[i].meta.capacity())*sizeof(float);
     }
-    
-    return min_value;
+    for(int i=0; i<foundations.size(); ++i){
+      bytes += foundations[i].Bytes();
+    }
+    return bytes;
+  }
+ 
+  State const* GetMinValueParticle() const{
+    return GetParticle(GetMinValueParticleIdx());
   }
   
-  float GetMaxValue() const{
-    float max_value = particles[0].second;
-    
-    for(int i=1; i<particles.size(); ++i){
-      if(particles[i].second>max_value){
-        max_value = particles[i].second;
+  int GetMinValueParticleIdx() const{
+    if(!min_valid){
+      min_idx = 0;
+      for(int i=1; i<values.size(); ++i){
+        if(values[i]<values[min_idx]){
+          min_idx = i;
+        }
       }
+      min_valid = true;
     }
     
-    return max_value;
+    return min_idx;
   }
   
-  size_t Size() const { return particles.size(); }
+  int GetMaxValueParticleIdx() const{
+    return heap[0];
+  }
+  
+  float GetMinValue() const{
+    return values[GetMinValueParticleIdx()];
+  }
+  
+  float GetMaxValue() const{
+    return values[heap[0]];
+  }
+  
+  size_t Size() const { return values.size(); }
   
   std::string Summary() const
   {
     std::stringstream summary;
-    for(int i=0; i<particles.size(); ++i){
-      summary << "value [" << particles[i].second << "] at " << particles[i].first.Summary() << std::endl;
+    for(int i=0; i<values.size(); ++i){
+      summary << "value [" << values[i] << "] at " << GetParticle(i)->Summary() << std::endl;
     }
     
     return summary.str();
   }
   
 private:
-  std::vector<WeightedState> particles;   // Particle positions and disbelief values
-  std::vector<Message> foundations;
-};
+  // The compact foundations start with the step and the lowest value of each
+  // direction, as floats
+  static const int kCompactHeader = 5*sizeof(float)/sizeof(unsigned short);
   
-//------------------------------------------------------------------------------
+  float GetCompactStep() const{
+    float step;
+    memcpy(&step, &compact[0], sizeof(step));
+    return step;
+  }
+  
+  float GetCompactBase(int direction) const{
+    float base;
+    memcpy(&base, &compact[(1+direction)*sizeof(float)/sizeof(unsigned short)], sizeof(base));
+    return base;
+  }
+  
+  void SetCompactBase(int direction, float base){
+    memcpy(&compact[(1+direction)*sizeof(float)/sizeof(unsigned short)], &base, sizeof(base));
+  }
+  
+  unsigned short Quantise(float offset) const{
+    float step = GetCompactStep();
+    if(offset <= 0.f){
+      return 0;
+    }
+    if(step == 0.f || offset >= 65535.f*step){
+      return 65535;
+    }
+    return (unsigned short)(offset/step + 0.5f);
+  }
+  
+  template <class T>
+  static void PackValue(std::vector<char>& buffer, const T& value){
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes+sizeof(T));
+  }
+  
+  template <class T>
+  static void PackVector(std::vector<char>& buffer, const std::vector<T>& vector){
+    int size = vector.size();
+    PackValue(buffer, size);
+    if(size){
+      const char* bytes = reinterpret_cast<const char*>(&vector[0]);
+      buffer.insert(buffer.end(), bytes, bytes+size*sizeof(T));
+    }
+  }
+  
+  template <class T>
+  static const char* UnpackValue(const char* data, T& value){
+    memcpy(&value, data, sizeof(T));
+    return data + sizeof(T);
+  }
+  
+  template <class T>
+  static const char* UnpackVector(const char* data, std::vector<T>& vector){
+    int size;
+    data = UnpackValue(data, size);
+    vector.resize(size);
+    if(size){
+      memcpy(&vector[0], data, size*sizeof(T));
+    }
+    return data + size*sizeof(T);
+  }
+  
+  void Allocate(int k){
+    values.resize(k);
+    foundations.resize(4);
+    heap.resize(k);
+    heap_position.resize(k);
+    for(int i=0; i<k; ++i){
+      heap[i] = i;
+      heap_position[i] = i;
+    }
+  }
+  
+  // Particle ordering, ties are broken by index
+  bool IsHigher(int a, int b) const{
+    return values[a] > values[b] || (values[a] == values[b] && a < b);
+  }
+  
+  bool IsLower(int a, int b) const{
+    return values[a] < values[b] || (values[a] == values[b] && a < b);
+  }
   
-typedef Field<Node> NodeField;
+  void SwapHeap(int i, int j){
+    std::swap(heap[i], heap[j]);
+    heap_position[heap[i]] = i;
+    heap_position[heap[j]] = j;
+  }
+  
+  void SiftUp(int i){
+    while(i > 0){
+      int parent = (i-1)/2;
+      if(!IsHigher(heap[i], heap[parent])){
+        break;
+      }
+      SwapHeap(i, parent);
+      i = parent;
+    }
+  }
+  
+  void SiftDown(int i){
+    int size = heap.size();
+    while(true){
+      int largest = i;
+      int left = 2*i+1;
+      int right = 2*i+2;
+      if(left < size && IsHigher(heap[left], heap[largest])){
+        largest = left;
+      }
+      if(right < size && IsHigher(heap[right], heap[largest])){
+        largest = right;
+      }
+      if(largest == i){
+        break;
+      }
+      SwapHeap(i, largest);
+      i = largest;
+    }
+  }
+  
+  std::vector<State> states;              // Particle positions, unless labels are shared
+  std::vector<float> values;              // Disbelief values
+  StateVector const* labels;              // Shared label table, or null
+  std::vector<int> label_indices;         // Subset of the shared labels, empty if all
+  std::vector<Message> foundations;
+  std::vector<unsigned short> compact;    // Foundations in fixed point, empty if stored as floats
+  std::vector<int> heap;                  // Particle indices, max-heap on disbelief
+  std::vector<int> heap_position;         // Position of each particle in the heap
+  mutable int min_idx;                    // Cached index of the best particle
+  mutable bool min_valid;
+};
   
 //------------------------------------------------------------------------------
 }
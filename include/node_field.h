@@ -0,0 +1,98 @@
+#ifndef fpmbp_node_field_h
+#define fpmbp_node_field_h
+
+//------------------------------------------------------------------------------
+
+#include <vector>
+#include <cstdio>
+#include <cstddef>
+#include "node.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Nodes of a view, stored by rows. A paged field only keeps a window of
+// bands of rows in memory and writes the others to a scratch file: a band
+// is read back when one of its nodes is accessed, and the resident band
+// farthest from it is written out to make room. Sweeps, which visit the
+// rows in order, therefore stream the bands through the window. A node
+// pointer stays valid while fewer than max_bands other bands are accessed,
+// hence at least 3 bands are kept so that a row and its two neighbours are
+// resident together.
+
+class NodeField{
+ public:
+  NodeField();
+  NodeField(const NodeField& other);
+  ~NodeField();
+  
+  NodeField& operator=(const NodeField& other);
+  
+  void Resize(int w, int h);
+  void Swap(NodeField& other);
+  
+  // Pages the field by bands of band_rows rows, keeping at most max_bands of
+  // them in memory. Returns false, the field staying in memory, if no
+  // scratch file can be created.
+  bool Page(int band_rows, int max_bands);
+  bool IsPaged() const;
+  
+  size_t Width() const{return width;}
+  size_t Height() const{return height;}
+  
+  void Set(int i, int j, int k, const Node& node){
+    *Get(i, j, k) = node;
+  }
+  
+  Node const* Get(int i, int j, int k=0) const{
+    if(rows[j].empty()){
+      FaultIn(j);
+    }
+    return &rows[j][i];
+  }
+  
+  Node* Get(int i, int j, int k=0){
+    if(rows[j].empty()){
+      FaultIn(j);
+    }
+    return &rows[j][i];
+  }
+  
+  // Bands read from and written to the scratch file
+  long GetBandReads() const;
+  long GetBandWrites() const;
+
+ private:
+  void FaultIn(int row) const;
+  void Evict(int band) const;
+  void Clear();
+  
+  int width;
+  int height;
+  
+  // Rows of nodes, empty when paged out
+  mutable std::vector<std::vector<Node> > rows;
+  
+  // Paging, band_rows being 0 when the field is in memory
+  int band_rows;
+  int max_bands;
+  std::FILE* file;
+  mutable std::vector<int> resident;
+  mutable std::vector<long long> band_offsets;  // -1 until the band is first written
+  mutable std::vector<size_t> band_sizes;
+  mutable std::vector<size_t> band_capacities;
+  mutable long long file_size;
+  mutable long band_reads;
+  mutable long band_writes;
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef fpmbp_pipeline_h
+#define fpmbp_pipeline_h
+
+//------------------------------------------------------------------------------
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "image.h"
+#include "flo.h"
+#include "preprocessor.h"
+#include "thread_pool.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+class Solver;
+class GraphParticles;
+
+//------------------------------------------------------------------------------
+
+// Queue of at most capacity items between two stages: Push blocks while it
+// is full and Pop while it is empty, until Close is called.
+
+template <class T>
+class BoundedQueue{
+ public:
+  BoundedQueue(int capacity) : capacity(capacity), closed(false) {}
+  
+  void Push(const T& item){
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]{ return (int)items.size() < capacity; });
+    items.push_back(item);
+    not_empty.notify_one();
+  }
+  
+  // Returns false once the queue is closed and empty
+  bool Pop(T& item){
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this]{ return !items.empty() || closed; });
+    if(items.empty()){
+      return false;
+    }
+    item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  
+  void Close(){
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+ private:
+  int capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+//------------------------------------------------------------------------------
+
+// A pair of frames to solve, as indices in the frame list, and where its
+// results go
+struct PipelineJob{
+  int one;
+  int two;
+  std::string output_dir;
+  std::string prefix;
+};
+
+//------------------------------------------------------------------------------
+
+// Outputs of a solved pair, copied out of the graph so that they can be
+// written while the next pair is solving
+struct PipelineResults{
+  PipelineResults() : flo(0), success(false), solve_seconds(0) {}
+  ~PipelineResults(){ delete flo; }
+  
+  // The flow is owned, hence results are not copied
+  PipelineResults(const PipelineResults&) = delete;
+  PipelineResults& operator=(const PipelineResults&) = delete;
+  
+  void Collect(GraphParticles* graph);
+  
+  Image motion;
+  Image reconstruction;
+  Flo* flo;
+  std::string fields;
+  
+  bool success;
+  float solve_seconds;
+};
+
+//------------------------------------------------------------------------------
+
+// Runs the pairs of a frame list through four stages, each on its own
+// thread: load, preprocess, solve and export. While pair N is solving, the
+// frames of pair N+1 are decoded and preprocessed and the outputs of pair
+// N-1 are written. Stages are linked by queues of depth items, and each
+// accumulates the time it spends working, the rest being spent waiting.
+
+class Pipeline{
+ public:
+  typedef std::function<Image*(const std::string&)> LoadFunction;
+  typedef std::function<void(const PipelineJob&, const PipelineResults&)> ExportFunction;
+  // Gives the next job to solve, false once there are none left
+  typedef std::function<bool(PipelineJob&)> JobSource;
+  
+  // The preprocessing runs on pool, which can be shared with the solver
+  Pipeline(Solver* solver, int depth, ThreadPool* pool, LoadFunction load, ExportFunction save);
+  
+  // Solves the jobs in order
+  void Run(const std::vector<std::string>& frames, const std::vector<PipelineJob>& jobs);
+  
+  // Solves the jobs of a source in the order they are given. The load stage
+  // pulls them one job ahead of the frames it decodes, so that pipelines
+  // sharing a source take the pairs as they become free. A frame is loaded
+  // once for consecutive jobs using it, and released after the last of them.
+  void Run(const std::vector<std::string>& frames, JobSource next_job);
+  
+  // Restarts the random sequence before each pair, so that independent pairs
+  // are solved as by a single run. Off by default, as the pairs of a
+  // sequence follow on from each other.
+  void SetIndependentPairs(bool independent);
+  
+  enum Stage{
+    kLoad = 0,
+    kPreprocess,
+    kSolve,
+    kExport,
+    kNumStages
+  };
+  
+  // Time spent working by each stage, and length of the last run
+  float GetBusySeconds(Stage stage) const;
+  float GetWallSeconds() const;
+  void PrintUtilisation() const;
+
+ private:
+  Solver* solver;
+  int depth;
+  LoadFunction load;
+  ExportFunction save;
+  bool independent_pairs;
+  
+  Preprocessor preprocessor;
+  
+  int n_jobs;
+  float busy_seconds[kNumStages];
+  float wall_seconds;
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef fpmbp_preprocessor_h
+#define fpmbp_preprocessor_h
+
+//------------------------------------------------------------------------------
+
+#include <vector>
+#include "image.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+class ThreadPool;
+
+//------------------------------------------------------------------------------
+
+// An input image with its derived images, computed ahead of the solve
+struct PreparedImage{
+  PreparedImage() : image(0) {}
+  
+  Image* image;
+  Image gradient;
+  Image filtered;
+};
+
+//------------------------------------------------------------------------------
+
+// Computes the images derived from an input image before solving: the
+// gradient magnitude and the median filtered guidance image of the support
+// weights. Each row band is decoded once into planar channels and grey, then
+// filtered, the bands being spread over a thread pool.
+
+class Preprocessor{
+ public:
+  Preprocessor(ThreadPool* pool);
+  
+  // Resizes gradient and filtered, and fills them as image->GetGradient()
+  // and image->MedianFilter(median_size, pool) would
+  void Process(const Image* image, int median_size, Image* gradient, Image* filtered);
+  
+  // Same for the derived images of a prepared image
+  void Prepare(PreparedImage* prepared, int median_size);
+  
+ private:
+  void GradientRow(const unsigned char* grey, int width, int height, int y, int* out) const;
+  
+  ThreadPool* pool;
+  
+  // Planar buffers, kept from one image to the next
+  std::vector<unsigned char> in;
+  std::vector<unsigned char> out;
+  std::vector<unsigned char> grey;
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef fpmbp_solver_h
+#define fpmbp_solver_h
+
+//------------------------------------------------------------------------------
+
+#include "utils.h"
+#include "image_buffer.h"
+#include "preprocessor.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+class Image;
+class GraphParticles;
+class ThreadPool;
+
+//------------------------------------------------------------------------------
+
+// Long-lived solver for a sequence of image pairs. The graph is created once,
+// and each solve reuses its node storage, preprocessing buffers, image
+// operator and thread pool, so that memory does not grow with the number of
+// pairs as long as they are not larger than the first one. Solvers running
+// concurrently can share one thread pool, which must outlive them.
+
+class Solver{
+ public:
+  Solver(const Parameters& parameters, Application application, ThreadPool* pool=0);
+  ~Solver();
+  
+  // Solves for a new pair. The images must stay alive until the next solve,
+  // as outputs are computed from them.
+  void Solve(Image* one, Image* two);
+  void Solve(const ImageBuffer& one, const ImageBuffer& two);
+  void Solve(const PreparedImage& one, const PreparedImage& two);
+  
+  // Graph holding the solution of the last solve
+  GraphParticles* GetGraph() const;
+  
+ private:
+  GraphParticles* graph;
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
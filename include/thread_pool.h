@@ -0,0 +1,60 @@
+#ifndef fpmbp_thread_pool_h
+#define fpmbp_thread_pool_h
+
+//------------------------------------------------------------------------------
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Fixed set of worker threads running the iterations of a parallel loop.
+// The calling thread takes part in the loop, so a pool of size 1 has no
+// worker and runs everything in place. A pool can be shared by several
+// threads, whose loops then run one after the other.
+
+class ThreadPool{
+ public:
+  // n_threads=0 uses one thread per hardware core
+  ThreadPool(int n_threads);
+  ~ThreadPool();
+  
+  int Size() const;
+  
+  // Runs task(i) for i in [0,n) and returns once all of them are done.
+  // Not reentrant: a task must not start a loop on the same pool.
+  void ParallelFor(int n, const std::function<void(int)>& task);
+  
+ private:
+  void Work();
+  void RunTasks(std::unique_lock<std::mutex>& lock);
+  
+  std::vector<std::thread> workers;
+  std::mutex loop_mutex;  // Held by the thread whose loop is running
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  
+  // Current loop
+  const std::function<void(int)>* task;
+  int n_tasks;
+  int next_task;
+  int pending_tasks;
+  long generation;
+  bool stop;
+};
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
+
+#endif
@@ -53,6 +53,14 @@ View OtherView(View view){
   
 //------------------------------------------------------------------------------
   
+typedef enum{
+  kDiscrete,
+  kStereo,
+  k2DFlow
+} Application;
+  
+//------------------------------------------------------------------------------
+  
 enum Direction{
   kLeft = 0,
   kUp = 1,
@@ -152,9 +160,17 @@ public:
     return m+uniform(engine)*(M-m);
   }
   
-  static std::mt19937_64 engine;
-  static std::uniform_real_distribution<float> uniform;
-  static std::normal_distribution<float> normal;
+  // Restarts the sequence of the calling thread from the default seed
+  static void Reset(){
+    engine.seed(std::mt19937_64::default_seed);
+    uniform.reset();
+    normal.reset();
+  }
+  
+  // One generator per thread, so that graphs can be solved concurrently
+  static thread_local std::mt19937_64 engine;
+  static thread_local std::uniform_real_distribution<float> uniform;
+  static thread_local std::normal_distribution<float> normal;
 };
     
 //------------------------------------------------------------------------------
@@ -177,9 +193,33 @@ struct Parameters
   float border;
   float output_disparity_scale;
   float discrete_step;
+  int beam_width;
+  int beam_period;
+  bool beam_reference;
+  bool offset_table;
+  int n_levels;
+  int level_iterations;
   bool bidirectional;
+  bool ordered_patch;
+  bool incremental_patch;
+  bool rectified;
+  float bound_scale;
+  bool compact_storage;
+  int node_budget;
+  int band_rows;
+  int n_threads;
+  bool verbose;
+  bool track_energy;
+  bool warm_start;
+  int warm_iterations;
+  std::string sequence_file;
+  int pipeline_depth;
+  int fields_compression;
+  std::string batch_file;
+  int batch_jobs;
   std::string output_dir;
   std::string import_file;
+  std::string stats_file;
   
   float infinity;
 };
@@ -209,13 +249,17 @@ public:
     Resize(w, h, 1);
   }
   
+  void Swap(Field<T>& other){
+    data_.swap(other.data_);
+  }
+  
   std::vector<std::vector<T> > & operator[](int i){
     return data_[i];
   }
   
-  size_t Width(){return data_.size();}
-  size_t Height(){return data_[0].size();}
-  size_t K(){ return data_[0][0].size();}
+  size_t Width() const{return data_.size();}
+  size_t Height() const{return data_[0].size();}
+  size_t K() const{ return data_[0][0].size();}
   
   void Set(int i, int j, int k, const T& v){
     data_[i][j][k] = v;
@@ -267,12 +311,16 @@ public:
     }
   }
   
+  void Swap(Mask& other){
+    data_.swap(other.data_);
+  }
+  
   std::vector<bool> & operator[](int i){
     return data_[i];
   }
   
-  size_t Width(){return data_.size();}
-  size_t Height(){return data_[0].size();}
+  size_t Width() const{return data_.size();}
+  size_t Height() const{return data_[0].size();}
   
   void Set(int i, int j, bool v){
     data_[i][j] = v;
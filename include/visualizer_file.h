@@ -0,0 +1,42 @@
+#ifndef fpmbp_visualizer_file_h
+#define fpmbp_visualizer_file_h
+
+//------------------------------------------------------------------------------
+
+#include "visualizer.h"
+#include "image_reader_cimg.h"
+#include <sstream>
+#include <iomanip>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp{
+  
+//------------------------------------------------------------------------------
+  
+// Saves each shown image to a numbered png, e.g. <prefix>003.png
+  
+class VisualizerFile : public Visualizer{
+public:
+  VisualizerFile(const std::string& prefix) : Visualizer(prefix), m_count(0) {}
+  virtual~ VisualizerFile(){}
+  
+  virtual void Show(const Image& image){
+    std::stringstream ss;
+    ss << m_title << std::setw( 3 ) << std::setfill( '0' ) << m_count++ << ".png";
+    
+    ImageReaderCImg ireader;
+    ireader.save(const_cast<Image*>(&image), ss.str());
+  }
+  
+private:
+  int m_count;
+};
+  
+//------------------------------------------------------------------------------
+  
+}
+
+//------------------------------------------------------------------------------
+
+#endif
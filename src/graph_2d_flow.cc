@@ -48,9 +48,10 @@ float Graph2DFlow::PairwiseEnergy(View view, int x1, int y1, const State& state1
 
 //------------------------------------------------------------------------------
   
-State Graph2DFlow::GetRandomState(View view, int x, int y) const
+void Graph2DFlow::GetRandomState(View view, int x, int y, State& state) const
 {
-  State state(data_dim, meta_dim);
+  state.data.resize(data_dim);
+  state.meta.resize(meta_dim);
   
   // Use the maximum dimension unless max_motion is set to 0
   float max_motion = (parameters.max_motion==0.f?std::max(w[view], h[view]):parameters.max_motion);
@@ -60,15 +61,13 @@ State Graph2DFlow::GetRandomState(View view, int x, int y) const
     state.data[0] = max_motion*Random::DrawUniform(-1.f, 1.f);
     state.data[1] = max_motion*Random::DrawUniform(-1.f, 1.f);
   } while(!image_operator->IsStateValid(view, x, y, state));
-  
-  return state;
 }
   
 //------------------------------------------------------------------------------
   
-State Graph2DFlow::GetRandomStateAround(View view, int x, int y, const State& current, float ratio) const
+void Graph2DFlow::GetRandomStateAround(View view, int x, int y, const State& current, float ratio, State& state) const
 {
-  State state = current;
+  state = current;
   
   // Use the maximum dimension unless max_motion is set to 0
   float max_motion = (parameters.max_motion==0.f?std::max(w[view], h[view]):parameters.max_motion);
@@ -80,16 +79,14 @@ State Graph2DFlow::GetRandomStateAround(View view, int x, int y, const State& cu
   if(!image_operator->IsStateValid(view, x, y, state)){
     state = current;
   }
-  
-  return state;
 }
 
 //------------------------------------------------------------------------------
   
-State Graph2DFlow::GetStateFromNeighbour(View view, int x, int y, int nx, int ny) const
+void Graph2DFlow::GetStateFromNeighbour(View view, int x, int y, int nx, int ny, State& state) const
 {
   // Retrieve best state of the neighbour
-  return GetMinDisbeliefState(view, nx, ny)->Copy();
+  state = *GetMinDisbeliefState(view, nx, ny);
 }
   
 //------------------------------------------------------------------------------
@@ -1,6 +1,8 @@
 //------------------------------------------------------------------------------
 
 #include "graph_discrete.h"
+#include "min_convolution.h"
+#include <algorithm>
 
 //------------------------------------------------------------------------------
 
@@ -18,10 +20,84 @@ GraphDiscrete::GraphDiscrete(const Parameters& p) : GraphParticles(p)
   data_dim = 2; // 2d displacement
   meta_dim = 0;
   float max_motion = (parameters.max_motion==0.f?std::max(w[kOne], h[kTwo]):parameters.max_motion);
-  int side = (2*max_motion+1)/parameters.discrete_step;
-  parameters.n_particles = side*side;
+  
+  // For all possible discrete state
+  for(int v=-max_motion; v<=max_motion; v+=parameters.discrete_step){
+    label_side = 0;
+    for(int u=-max_motion; u<=max_motion; u+=parameters.discrete_step){
+      labels.push_back(GetFixedState(u, v));
+      ++label_side;
+    }
+  }
+  
+  parameters.n_particles = labels.size();
+  
+  // In beam mode, nodes only keep the best labels
+  if(parameters.beam_width > 0){
+    parameters.n_particles = std::min(parameters.beam_width, (int)labels.size());
+  }
   
   std::cout << "Discrete BP, setting particle number: " << parameters.n_particles << std::endl;
+  
+  // The pyramid of unaries and the coarse levels are held in memory over the
+  // whole grid with every label, which a node budget cannot bound
+  if(parameters.n_levels > 1 && parameters.node_budget > 0){
+    std::cerr << "Error: multi-grid is disabled under a node budget, running on the full grid only" << std::endl;
+    parameters.n_levels = 1;
+  }
+  
+  if(!IsBeam()){
+    BuildPairwiseTable();
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GraphDiscrete::BuildPairwiseTable()
+{
+  // The pairwise energy only depends on the labels
+  int n = labels.size();
+  label_rows = n/label_side;
+  
+  // Check that the labels lie on a regular grid
+  float step_u = (label_side>1 ? labels[1].data[0]-labels[0].data[0] : 0.f);
+  float step_v = (label_rows>1 ? labels[label_side].data[1]-labels[0].data[1] : 0.f);
+  bool regular = true;
+  
+  for(int k=0; k<n; ++k){
+    regular &= (labels[k].data[0] == labels[0].data[0] + (k%label_side)*step_u);
+    regular &= (labels[k].data[1] == labels[0].data[1] + (k/label_side)*step_v);
+  }
+  
+  size_t dense_size = n*n*sizeof(float);
+  size_t offset_size = (2*label_side-1)*(2*label_rows-1)*sizeof(float);
+  
+  if(parameters.offset_table && regular){
+    // On a regular grid it only depends on the label offset, tabulate it for
+    // all the offsets between two labels
+    offset_table.resize((2*label_side-1)*(2*label_rows-1));
+    State origin = GetFixedState(0, 0);
+    
+    for(int dv=-(label_rows-1); dv<=label_rows-1; ++dv){
+      for(int du=-(label_side-1); du<=label_side-1; ++du){
+        State offset = GetFixedState(du*step_u, dv*step_v);
+        offset_table[(dv+label_rows-1)*(2*label_side-1)+du+label_side-1] = PairwiseEnergy(kOne, 0, 0, origin, 0, 0, offset);
+      }
+    }
+    
+    std::cout << "Discrete BP, pairwise table by offset: " << offset_size/1024.f << " KB (dense: " << dense_size/1024.f << " KB)" << std::endl;
+  }else{
+    // Otherwise tabulate it for all pairs
+    pairwise_table.resize(n*n);
+    
+    for(int t=0; t<n; ++t){
+      for(int s=0; s<n; ++s){
+        pairwise_table[t*n+s] = PairwiseEnergy(kOne, 0, 0, labels[t], 0, 0, labels[s]);
+      }
+    }
+    
+    std::cout << "Discrete BP, dense pairwise table: " << dense_size/1024.f << " KB (by offset: " << offset_size/1024.f << " KB)" << std::endl;
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -35,17 +111,170 @@ GraphDiscrete::~GraphDiscrete()
 
 void GraphDiscrete::InitialiseNode(View view, int x, int y)
 {
-  float max_motion = (parameters.max_motion==0.f?std::max(w[kOne], h[kTwo]):parameters.max_motion);
-  int count = 0;
-  // For all possible discrete state
-  for(int v=-max_motion; v<=max_motion; v+=parameters.discrete_step){
-    for(int u=-max_motion; u<=max_motion; u+=parameters.discrete_step){
-      State state = GetFixedState(u, v);
-      float unary = UnaryEnergy(view, x, y, state, parameters.infinity);
-      nodes[view].Get(x, y)->SetParticle(count, state, unary);
-      ++count;
+  Node* node = nodes[view].Get(x, y);
+  
+  if(!IsBeam()){
+    for(int k=0; k<labels.size(); ++k){
+      float unary = UnaryEnergy(view, x, y, labels[k], parameters.infinity);
+      node->SetParticleValue(k, unary);
+    }
+    return;
+  }
+  
+  // Beam: evaluate all the labels and keep the ones with the lowest unary
+  std::vector<float> unaries(labels.size());
+  std::vector<int> order(labels.size());
+  
+  for(int k=0; k<labels.size(); ++k){
+    unaries[k] = UnaryEnergy(view, x, y, labels[k], parameters.infinity);
+    order[k] = k;
+  }
+  
+  int n = node->Size();
+  std::partial_sort(order.begin(), order.begin()+n, order.end(), [&unaries](int a, int b){
+    return unaries[a] < unaries[b] || (unaries[a] == unaries[b] && a < b);
+  });
+  
+  for(int k=0; k<n; ++k){
+    node->SetLabel(k, order[k], unaries[order[k]]);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GraphDiscrete::InitialiseNodes(View view)
+{
+  GraphParticles::InitialiseNodes(view);
+  
+  if(parameters.n_levels <= 1 || IsBeam()){
+    return;
+  }
+  
+  int n = labels.size();
+  
+  // Build the pyramid of unaries, the finest level being the initial values
+  std::vector<std::vector<float> > unaries(parameters.n_levels);
+  std::vector<int> widths(parameters.n_levels);
+  std::vector<int> heights(parameters.n_levels);
+  
+  widths[0] = w[view];
+  heights[0] = h[view];
+  unaries[0].resize(w[view]*h[view]*n);
+  
+  for(int j=0; j<h[view]; ++j){
+    for(int i=0; i<w[view]; ++i){
+      for(int k=0; k<n; ++k){
+        unaries[0][(j*w[view]+i)*n+k] = nodes[view].Get(i, j)->GetDisbelief(k);
+      }
+    }
+  }
+  
+  for(int l=1; l<parameters.n_levels; ++l){
+    widths[l] = (widths[l-1]+1)/2;
+    heights[l] = (heights[l-1]+1)/2;
+    unaries[l].assign(widths[l]*heights[l]*n, 0.f);
+    
+    for(int j=0; j<heights[l-1]; ++j){
+      for(int i=0; i<widths[l-1]; ++i){
+        float const* fine = &unaries[l-1][(j*widths[l-1]+i)*n];
+        float* coarse = &unaries[l][((j/2)*widths[l]+i/2)*n];
+        for(int k=0; k<n; ++k){
+          coarse[k] += fine[k];
+        }
+      }
+    }
+  }
+  
+  // Solve from the coarsest level, each level starting from the foundations
+  // of its parent
+  NodeField fine_nodes;
+  fine_nodes.Swap(nodes[view]);
+  
+  NodeField parent;
+  
+  for(int l=parameters.n_levels-1; l>=0; --l){
+    NodeField level_nodes;
+    
+    if(l>0){
+      level_nodes.Resize(widths[l], heights[l]);
+      for(int j=0; j<heights[l]; ++j){
+        for(int i=0; i<widths[l]; ++i){
+          level_nodes.Set(i, j, 0, CreateInitialNode());
+        }
+      }
+    }else{
+      level_nodes.Swap(fine_nodes);
+    }
+    
+    if(l<parameters.n_levels-1){
+      for(int j=0; j<heights[l]; ++j){
+        for(int i=0; i<widths[l]; ++i){
+          Node* child = level_nodes.Get(i, j);
+          Node const* source = parent.Get(i/2, j/2);
+          child->CopyFoundations(*source);
+        }
+      }
+    }
+    
+    if(l>0){
+      level_nodes.Swap(nodes[view]);
+      level_unaries.swap(unaries[l]);
+      SolveCoarseLevel(view, widths[l], heights[l]);
+      level_unaries.swap(unaries[l]);
+      level_nodes.Swap(nodes[view]);
+      parent.Swap(level_nodes);
+    }else{
+      level_nodes.Swap(nodes[view]);
     }
   }
+  
+  level_unaries.clear();
+}
+
+//------------------------------------------------------------------------------
+
+void GraphDiscrete::SolveCoarseLevel(View view, int width, int height)
+{
+  // Run the message passing on the coarse grid currently held in nodes[view]
+  int fine_w = w[view];
+  int fine_h = h[view];
+  Mask fine_processed;
+  fine_processed.Swap(processed[view]);
+  
+  w[view] = width;
+  h[view] = height;
+  processed[view].Resize(width, height);
+  
+  if(parameters.verbose){
+    std::cout << "Discrete BP, coarse level [" << width << "," << height << "]: " << parameters.level_iterations << " iterations" << std::endl;
+  }
+  
+  for(int it=0; it<parameters.level_iterations; ++it){
+    int i_first, i_last, j_first, j_last, i_incr, j_incr;
+    GetDirections(it, view, i_first, i_last, j_first, j_last, i_incr, j_incr);
+    
+    for(int j=j_first; j!=j_last; j+=j_incr){
+      for(int i=i_first; i!=i_last; i+=i_incr){
+        UpdateCurrentDisbelief(view, i, j);
+        Cache(view, i, j);
+      }
+    }
+  }
+  
+  w[view] = fine_w;
+  h[view] = fine_h;
+  fine_processed.Swap(processed[view]);
+}
+
+//------------------------------------------------------------------------------
+
+Node GraphDiscrete::CreateNode() const
+{
+  if(IsBeam()){
+    return Node(&labels, parameters.n_particles);
+  }
+  
+  return Node(&labels);
 }
 
 //------------------------------------------------------------------------------
@@ -53,6 +282,71 @@ void GraphDiscrete::InitialiseNode(View view, int x, int y)
 void GraphDiscrete::Update(View view, int x, int y)
 {
   // Discrete case, there is no particle to update as our particles are fixed
+  if(!IsBeam()){
+    return;
+  }
+  
+  // Beam case, propagate the best labels of the neighbours
+  if(x>0){
+    ProposeLabel(view, x, y, GetBestLabel(view, x-1, y));
+  }
+  
+  if(y>0){
+    ProposeLabel(view, x, y, GetBestLabel(view, x, y-1));
+  }
+  
+  if(x<w[view]-1){
+    ProposeLabel(view, x, y, GetBestLabel(view, x+1, y));
+  }
+  
+  if(y<h[view]-1){
+    ProposeLabel(view, x, y, GetBestLabel(view, x, y+1));
+  }
+  
+  // and periodically re-expand from the full label set around the best label
+  if(parameters.beam_period > 0 && iteration % parameters.beam_period == parameters.beam_period-1){
+    int best = GetBestLabel(view, x, y);
+    int best_u = best % label_side;
+    int best_v = best / label_side;
+    int label_rows = labels.size() / label_side;
+    
+    for(int v = std::max(best_v-kBeamRadius, 0); v <= std::min(best_v+kBeamRadius, label_rows-1); ++v){
+      for(int u = std::max(best_u-kBeamRadius, 0); u <= std::min(best_u+kBeamRadius, label_side-1); ++u){
+        ProposeLabel(view, x, y, v*label_side+u);
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GraphDiscrete::ProposeLabel(View view, int x, int y, int label)
+{
+  Node* node = nodes[view].Get(x, y);
+  
+  // The beam holds each label at most once
+  if(node->FindLabel(label) >= 0){
+    return;
+  }
+  
+  // Look for the highest value
+  int idx = node->GetMaxValueParticleIdx();
+  float highest_value = node->GetMaxValue();
+  
+  float B = EvaluateDisbelief(view, x, y, labels[label], true);
+  
+  if(B<highest_value){
+    propagated[view].Set(x, y, true);
+    node->SetLabel(idx, label, B);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+int GraphDiscrete::GetBestLabel(View view, int x, int y) const
+{
+  Node const* node = nodes[view].Get(x, y);
+  return node->GetLabel(node->GetMinValueParticleIdx());
 }
 
 //------------------------------------------------------------------------------
@@ -87,6 +381,47 @@ float GraphDiscrete::PairwiseEnergy(View view, int x1, int y1, const State& stat
   
 //------------------------------------------------------------------------------
 
+float GraphDiscrete::ParticleUnaryEnergy(View view, int x, int y, int k) const
+{
+  // On a coarse level, the unary is the sum over the block of pixels
+  if(!level_unaries.empty()){
+    return level_unaries[(y*w[view]+x)*labels.size()+k];
+  }
+  
+  return GraphParticles::ParticleUnaryEnergy(view, x, y, k);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphDiscrete::EvaluateMessages(View view, int from_x, int from_y, int to_x, int to_y, float* messages) const
+{
+  if(pairwise_table.empty() && offset_table.empty()){
+    GraphParticles::EvaluateMessages(view, from_x, from_y, to_x, to_y, messages);
+    return;
+  }
+  
+  // Both nodes hold all the labels, in the order of the table
+  Node const* source = nodes[view].Get(from_x, from_y);
+  Direction direction = GetDirection(from_x, from_y, to_x, to_y);
+  
+  PMBP_COUNT_N(kMessageEvaluations, source->Size());
+  
+  // Compact foundations are decoded first, into a buffer kept by the graph
+  if(source->HasCompactFoundations()){
+    decoded_foundation.resize(source->Size());
+  }
+  const float* foundation = source->GetFoundationData(direction, decoded_foundation.data());
+  
+  if(!offset_table.empty()){
+    OffsetMinConvolution(&offset_table[0], foundation, label_side, label_rows, messages);
+  }else{
+    int n = labels.size();
+    MinConvolution(&pairwise_table[0], foundation, n, n, messages);
+  }
+}
+
+//------------------------------------------------------------------------------
+
 void GraphDiscrete::GetDisplacement(float x, float y, const State& state, float& dx, float& dy) const
 {
   dx = state.data[0];
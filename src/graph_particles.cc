@@ -1,12 +1,15 @@
 #include "graph_particles.h"
-#include "visualizer_cimg.h"
+#include "preprocessor.h"
+#include "visualizer.h"
 #include "flo_io.h"
 #include "image_operator.h"
 #include "colorcode.h"
 #include <limits>
-
-#include "image_reader_cimg.h" // Temporary
-#include <iomanip>
+#include <cmath>
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+#include <zlib.h>
 
 using namespace std;
 using namespace std::placeholders;
@@ -15,21 +18,104 @@ namespace pmbp{
   
 //------------------------------------------------------------------------------
 
+namespace {
+
+// Fields files, see ExportFields
+const char kFieldsMagic[4] = {'P', 'M', 'B', 'F'};
+const int kFieldsVersion = 3;
+const int kFieldsRowsPerChunk = 16;
+const int kFieldsNone = 0;
+const int kFieldsZlib = 1;
+const int kFieldsMaxParticles = 1<<16;
+
+}
+  
+//------------------------------------------------------------------------------
+
 GraphParticles::GraphParticles(const Parameters& p) : parameters(p)
 {
   image_operator = 0;
+  iteration = 0;
+  bound_tests = 0;
+  bound_rejections = 0;
+  warm_started = false;
+  mapped_rows_per_chunk = 0;
+  thread_pool = 0;
+  owns_thread_pool = false;
+  preprocessor = 0;
+  wrapped[kOne] = 0;
+  wrapped[kTwo] = 0;
+  gradients[kOne] = new Image();
+  gradients[kTwo] = new Image();
+  filtered[kOne] = new Image();
+  filtered[kTwo] = new Image();
 }
 
 //------------------------------------------------------------------------------
 
 GraphParticles::~GraphParticles()
 {
+  delete image_operator;
+  delete preprocessor;
+  if(owns_thread_pool){
+    delete thread_pool;
+  }
+  delete wrapped[kOne];
+  delete wrapped[kTwo];
+  delete gradients[kOne];
+  delete gradients[kTwo];
+  delete filtered[kOne];
+  delete filtered[kTwo];
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::SetThreadPool(ThreadPool* pool)
+{
+  delete preprocessor;
+  if(owns_thread_pool){
+    delete thread_pool;
+  }
   
+  thread_pool = pool;
+  owns_thread_pool = false;
+  preprocessor = new Preprocessor(thread_pool);
 }
 
 //------------------------------------------------------------------------------
 
 void GraphParticles::InitialiseImages(Image* one, Image* two)
+{
+  // The graph has its own threads unless it was given a shared pool
+  if(!thread_pool){
+    thread_pool = new ThreadPool(parameters.n_threads);
+    owns_thread_pool = true;
+    preprocessor = new Preprocessor(thread_pool);
+  }
+  
+  // Derived images, reusing the storage of the previous pair
+  preprocessor->Process(one, 3, gradients[kOne], filtered[kOne]);
+  preprocessor->Process(two, 3, gradients[kTwo], filtered[kTwo]);
+  
+  SetImages(one, two);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::InitialiseImages(const PreparedImage& one, const PreparedImage& two)
+{
+  // The derived images were computed ahead, copy them in place
+  gradients[kOne]->CopyFrom(one.gradient);
+  gradients[kTwo]->CopyFrom(two.gradient);
+  filtered[kOne]->CopyFrom(one.filtered);
+  filtered[kTwo]->CopyFrom(two.filtered);
+  
+  SetImages(one.image, two.image);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::SetImages(Image* one, Image* two)
 {
   images[kOne] = one;
   images[kTwo] = two;
@@ -37,10 +123,11 @@ void GraphParticles::InitialiseImages(Image* one, Image* two)
   h[kOne] = one->height;
   w[kTwo] = two->width;
   h[kTwo] = two->height;
-  gradients[kOne] = images[kOne]->GetGradient();
-  gradients[kTwo] = images[kTwo]->GetGradient();
-  filtered[kOne] = images[kOne]->MedianFilter(3);
-  filtered[kTwo] = images[kTwo]->MedianFilter(3);
+  
+  if(image_operator){
+    image_operator->Reset();
+    return;
+  }
   
   // Bind the function to the GetDisplacement of this object
   auto f = &GraphParticles::GetDisplacement;
@@ -51,6 +138,18 @@ void GraphParticles::InitialiseImages(Image* one, Image* two)
 
 //------------------------------------------------------------------------------
 
+void GraphParticles::InitialiseImages(const ImageBuffer& one, const ImageBuffer& two)
+{
+  delete wrapped[kOne];
+  delete wrapped[kTwo];
+  wrapped[kOne] = WrapImageBuffer(one);
+  wrapped[kTwo] = WrapImageBuffer(two);
+  
+  InitialiseImages(wrapped[kOne], wrapped[kTwo]);
+}
+
+//------------------------------------------------------------------------------
+
 void GraphParticles::InitialiseFields(){
   if(parameters.bidirectional)
   {
@@ -62,6 +161,22 @@ void GraphParticles::InitialiseFields(){
 //------------------------------------------------------------------------------
   
 void GraphParticles::InitialiseFields(View view){
+  // Beyond the memory budget, the nodes are paged to a scratch file by bands.
+  // Bands are sized from a node whose particles hold their states.
+  if(parameters.node_budget > 0){
+    Node node = CreateInitialNode();
+    State state(data_dim, meta_dim);
+    for(int k=0; k<node.Size(); ++k){
+      node.SetParticle(k, state, 0);
+    }
+    
+    size_t band_bytes = std::max<size_t>(node.Bytes()*w[view]*parameters.band_rows, 1);
+    int max_bands = std::min<size_t>(parameters.node_budget*size_t(1<<20)/band_bytes, h[view]);
+    if(!nodes[view].Page(parameters.band_rows, max_bands)){
+      std::cerr << "Error: could not create a scratch file, the nodes of view " << view << " stay in memory" << std::endl;
+    }
+  }
+  
   // Allocate memory
   nodes[view].Resize(w[view], h[view]);
   processed[view].Resize(w[view], h[view]);
@@ -70,17 +185,38 @@ void GraphParticles::InitialiseFields(View view){
   propagated[kOne].SetAll(false);
   propagated[kTwo].SetAll(false);
 
-  // Reserve memory for nodes
+  // Reset the nodes by copying an initial one, which reuses the storage the
+  // nodes already have from a previous pair
+  Node node = CreateInitialNode();
+  
   for(int j=0; j<h[view]; ++j){
     for(int i=0; i<w[view]; ++i){
-      nodes[view].Set(i, j, 0, Node(parameters.n_particles));
-      nodes[view].Get(i,j)->InitialiseFoundation();
+      nodes[view].Set(i, j, 0, node);
     }
   }
 }
 
 //------------------------------------------------------------------------------
   
+Node GraphParticles::CreateNode() const
+{
+  return Node(parameters.n_particles);
+}
+  
+//------------------------------------------------------------------------------
+  
+Node GraphParticles::CreateInitialNode() const
+{
+  Node node = CreateNode();
+  if(parameters.compact_storage){
+    node.UseCompactFoundations(parameters.weight_pw*parameters.truncate_pw);
+  }
+  node.InitialiseFoundation();
+  return node;
+}
+  
+//------------------------------------------------------------------------------
+  
 void GraphParticles::InitialiseNodes(){
 
   // If there is no import file
@@ -113,11 +249,69 @@ void GraphParticles::InitialiseNodes(View view)
   
 //------------------------------------------------------------------------------
 
+bool GraphParticles::CanWarmStart() const
+{
+  if(!parameters.warm_start || !parameters.import_file.empty()){
+    return false;
+  }
+  
+  // The nodes must hold the solution of a previous pair of the same size
+  for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+    if(nodes[view].Width() != w[view] || w[view] == 0 || nodes[view].Height() != h[view]){
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::WarmStart(View view)
+{
+  // The nodes keep their particles and foundations, and a copy of them is
+  // kept to propose the states of the previous pair along the motion
+  previous_nodes[view] = nodes[view];
+  propagated[view].SetAll(false);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::GetWarmStartState(View view, int x, int y, State& state) const
+{
+  // The content of pixel (x,y) was approximately at (x,y) minus the
+  // displacement in the previous pair
+  State const* previous = previous_nodes[view].Get(x, y)->GetMinValueParticle();
+  
+  float dx, dy;
+  GetDisplacement(x, y, *previous, dx, dy);
+  
+  int source_x = std::min(std::max((int)floor(x - dx + 0.5f), 0), w[view]-1);
+  int source_y = std::min(std::max((int)floor(y - dy + 0.5f), 0), h[view]-1);
+  
+  state = *previous_nodes[view].Get(source_x, source_y)->GetMinValueParticle();
+}
+
+//------------------------------------------------------------------------------
+
 void GraphParticles::Solve()
 {
-  // Initialise
-  InitialiseFields();
-  InitialiseNodes();
+  // Initialise, from the previous pair if possible
+  warm_started = CanWarmStart();
+  
+  if(warm_started){
+    if(parameters.bidirectional){
+      WarmStart(kTwo);
+    }
+    WarmStart(kOne);
+  }else{
+    InitialiseFields();
+    InitialiseNodes();
+  }
+  
+  int n_iterations = warm_started ? parameters.warm_iterations : parameters.n_iterations;
+  
+  instrumentation.NextSolve();
 
   // Energy tracking
   float unary_energy;
@@ -126,35 +320,100 @@ void GraphParticles::Solve()
   // Time logging
   Clock clock;
   
-  // Create visualizers
-  VisualizerCImg visu_motion("Motion", OutputMotionField(kOne));
-  //VisualizerCImg visu_unary("Unary Energy", OutputUnaryEnergy(kOne, unary_energy));
-  //VisualizerCImg visu_pairwise("Pairwise Energy", OutputPairwiseEnergy(kOne, pairwise_energy));
-  //VisualizerCImg visu_reconstruction("Reconstruction", OutputReconstruction(kOne));
+  // Show the initial solution, which needs all the imported rows
+  if(!visualizers.empty()){
+    FaultInAll();
+  }
+  Visualise();
     
   // Iterate
-  for(int i=0; i<parameters.n_iterations; ++i){
+  for(int i=0; i<n_iterations; ++i){
+    bound_tests = 0;
+    bound_rejections = 0;
+    
     Iterate(i);
     
     // Visualise
-    visu_motion.Show(OutputMotionField(kOne));
-    //visu_unary.Show(OutputUnaryEnergy(kOne, unary_energy));
-    //visu_pairwise.Show(OutputPairwiseEnergy(kOne, pairwise_energy));
-    //visu_reconstruction.Show(OutputReconstruction(kOne));
+    Visualise();
+    
+    if(!parameters.verbose){
+      continue;
+    }
 
     cout << "Iteration " << i << std::endl;
     cout << "  Time elapsed: " << clock.Poll() << "s" << std::endl;
-    //cout << "  Unary energy: " << unary_energy << endl;
-    //cout << "  Pairwise energy: " << pairwise_energy << endl;
-    //cout << "  Total energy: " << unary_energy + pairwise_energy << endl;
+    
+    // Energy of the current solution, a full pass over the nodes
+    if(parameters.track_energy){
+      OutputUnaryEnergy(kOne, unary_energy);
+      OutputPairwiseEnergy(kOne, pairwise_energy);
+      
+      cout << "  Unary energy: " << unary_energy << endl;
+      cout << "  Pairwise energy: " << pairwise_energy << endl;
+      cout << "  Total energy: " << unary_energy + pairwise_energy << endl;
+    }
+    if(parameters.bound_scale > 0.f){
+      cout << "  Bound rejections: " << bound_rejections << "/" << bound_tests << " (" << 100.f*bound_rejections/std::max(bound_tests, 1L) << "%)" << endl;
+    }
     DrawLine();
   }
+  
+  // Rows no iteration reached, for the outputs
+  FaultInAll();
+  
+  if(!parameters.stats_file.empty()){
+#ifdef PMBP_INSTRUMENTATION
+    // One line per solve, the first one of the graph starting the file
+    std::ofstream stats(parameters.stats_file.c_str(), instrumentation.GetSolve() ? std::ios::app : std::ios::trunc);
+    instrumentation.WriteJson(stats);
+#else
+    std::cerr << "Error: no statistics written to " << parameters.stats_file << ", PMBP was built without PMBP_INSTRUMENTATION" << std::endl;
+#endif
+  }
+  
+  if(parameters.verbose){
+    cout << "Node storage: " << GetNodeBytes(kOne) << " bytes per node" << endl;
+    if(nodes[kOne].IsPaged()){
+      cout << "Node paging: " << nodes[kOne].GetBandReads() << " bands read, " << nodes[kOne].GetBandWrites() << " written" << endl;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::AddVisualizer(Visualizer* visualizer)
+{
+  visualizers.push_back(visualizer);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::Visualise() const
+{
+  if(visualizers.empty()){
+    return;
+  }
+  
+  Image motion = OutputMotionField(kOne);
+  
+  for(int i=0; i<visualizers.size(); ++i){
+    visualizers[i]->Show(motion);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+const Image* GraphParticles::GetImage(View view) const
+{
+  return images[view];
 }
 
 //------------------------------------------------------------------------------
 
 void GraphParticles::Iterate(int it)
 {
+  iteration = it;
+  
   if(parameters.bidirectional)
   {
     IterateView(it, kTwo);
@@ -169,21 +428,24 @@ void GraphParticles::Iterate(int it)
   
 void GraphParticles::IterateView(int it, View view)
 {
-  ImageReaderCImg ireader;
-  std::stringstream ss;
-  ss << parameters.output_dir << "/motion_it_" <<  std::setw( 3 ) << std::setfill( '0' ) << it << ".png";
-  
-  Image motion = OutputMotionField(kOne);
-  ireader.save(&motion, ss.str());
-  
   int i_first, i_last, j_first, j_last, i_incr, j_incr;
   GetDirections(it, view, i_first, i_last, j_first, j_last, i_incr, j_incr);
   
   std::stringstream title;
   title << "[View " << view << "] - Iteration " << it << " -";
   
+#ifdef PMBP_INSTRUMENTATION
+  instrumentation.Begin(it, view);
+#endif
+  
   for(int j=j_first; j!=j_last; j+=j_incr){
-    ProgressBar(title.str(), abs(j-j_first), h[view]-1, std::min(h[view]-1, 200), 28);
+    // Rows of an imported field are only copied when the row or its
+    // neighbours are reached
+    FaultInRows(view, j-1, j+2);
+    
+    if(parameters.verbose){
+      ProgressBar(title.str(), abs(j-j_first), h[view]-1, std::min(h[view]-1, 200), 28);
+    }
     for(int i=i_first; i!=i_last; i+=i_incr){
       // Basic message passing operations
       
@@ -197,6 +459,10 @@ void GraphParticles::IterateView(int it, View view)
       Cache(view, i, j);
     }
   }
+  
+#ifdef PMBP_INSTRUMENTATION
+  instrumentation.End();
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -215,43 +481,46 @@ void GraphParticles::ResetProcessed()
 void GraphParticles::Cache(View view, int x, int y)
 {
   // Here we update the cached foundations
+  PMBP_TIME_PHASE(kCache);
   
   Node* node = nodes[view].Get(x, y);
-
-  for(int k=0; k<node->Size(); ++k){
-
-    State const* particle = node->GetParticle(k);
-    float d = node->GetDisbelief(k);
-    
-    if(x>0){
-      float m = EvaluateMessage(view, x-1, y, x, y, *particle);
-      float v = d - m;
-      node->SetFoundationValue(kLeft, k, v);
+  int size = node->Size();
+  std::vector<float>& messages = visit_messages;
+  std::vector<float>& foundation = visit_foundation;
+  messages.resize(size);
+  foundation.resize(size);
+  
+  if(x>0){
+    EvaluateMessages(view, x-1, y, x, y, &messages[0]);
+    for(int k=0; k<size; ++k){
+      foundation[k] = node->GetDisbelief(k) - messages[k];
     }
+    node->SetFoundation(kLeft, &foundation[0]);
+  }
 
-    if(y>0){
-      float m = EvaluateMessage(view, x, y-1, x, y, *particle);
-      float v = d - m;
-      node->SetFoundationValue(kUp, k, v);
-    }
-    
-    if(x<w[view]-1){
-      float m = EvaluateMessage(view, x+1, y, x, y, *particle);
-      float v = d - m;
-      node->SetFoundationValue(kRight, k, v);
+  if(y>0){
+    EvaluateMessages(view, x, y-1, x, y, &messages[0]);
+    for(int k=0; k<size; ++k){
+      foundation[k] = node->GetDisbelief(k) - messages[k];
     }
-    
-    if(y<h[view]-1){
-      float m = EvaluateMessage(view, x, y+1, x, y, *particle);
-      float v = d - m;
-      node->SetFoundationValue(kDown, k, v);
+    node->SetFoundation(kUp, &foundation[0]);
+  }
+  
+  if(x<w[view]-1){
+    EvaluateMessages(view, x+1, y, x, y, &messages[0]);
+    for(int k=0; k<size; ++k){
+      foundation[k] = node->GetDisbelief(k) - messages[k];
     }
+    node->SetFoundation(kRight, &foundation[0]);
   }
   
-  if(x>0) node->NormalizeFoundation(kLeft);
-  if(y>0) node->NormalizeFoundation(kUp);
-  if(x<w[view]-1) node->NormalizeFoundation(kRight);
-  if(y<h[view]-1) node->NormalizeFoundation(kDown);
+  if(y<h[view]-1){
+    EvaluateMessages(view, x, y+1, x, y, &messages[0]);
+    for(int k=0; k<size; ++k){
+      foundation[k] = node->GetDisbelief(k) - messages[k];
+    }
+    node->SetFoundation(kDown, &foundation[0]);
+  }
   
   // Set processed
   processed[view].Set(x, y, true);
@@ -267,9 +536,11 @@ void GraphParticles::ProposeCandidate(View view, int x, int y, const State& part
   int idx = node->GetMaxValueParticleIdx();
   float highest_value = node->GetMaxValue();
   
-  float B = EvaluateDisbelief(view, x, y, particle);
+  // Candidates worse than the highest value are rejected early
+  float B = EvaluateDisbelief(view, x, y, particle, true);
   
   if(B<highest_value){
+    PMBP_COUNT(kAcceptedCandidates);
     propagated[view].Set(x, y, true);
     nodes[view].Get(x, y)->SetParticle(idx, particle, B);
   }
@@ -305,6 +576,16 @@ float GraphParticles::EvaluateDisbelief(View view, int x, int y, const State& st
   
   if(early_termination){
     worst_value = GetMaxDisbelief(view, x, y) - message_sum;
+    
+    // Reject the candidate from the patch statistics if possible
+    if(parameters.bound_scale > 0.f){
+      ++bound_tests;
+      if(image_operator->PatchLowerBound(view, x, y, state) > worst_value){
+        ++bound_rejections;
+        PMBP_COUNT(kEarlyTerminations);
+        return parameters.infinity + message_sum;
+      }
+    }
   }
   float unary = UnaryEnergy(view, x, y, state, worst_value);
 
@@ -313,9 +594,19 @@ float GraphParticles::EvaluateDisbelief(View view, int x, int y, const State& st
 
 //------------------------------------------------------------------------------
   
+float GraphParticles::ParticleUnaryEnergy(View view, int x, int y, int k) const
+{
+  // Unary energy of the current k-th particle of the node
+  State const* particle = nodes[view].Get(x, y)->GetParticle(k);
+  return UnaryEnergy(view, x, y, *particle, parameters.infinity);
+}
+
+//------------------------------------------------------------------------------
+  
 float GraphParticles::EvaluateMessage(View view, int from_x, int from_y, int to_x, int to_y, const State& state) const
 {
   // Perform the miminization required to compute the message
+  PMBP_COUNT(kMessageEvaluations);
   float value = infinity;
   Node const* source = nodes[view].Get(from_x, from_y);
   
@@ -337,6 +628,18 @@ float GraphParticles::EvaluateMessage(View view, int from_x, int from_y, int to_
   
 //------------------------------------------------------------------------------
   
+void GraphParticles::EvaluateMessages(View view, int from_x, int from_y, int to_x, int to_y, float* messages) const
+{
+  // Message for every particle of the target node
+  Node const* target = nodes[view].Get(to_x, to_y);
+  
+  for(int k=0; k<target->Size(); ++k){
+    messages[k] = EvaluateMessage(view, from_x, from_y, to_x, to_y, *target->GetParticle(k));
+  }
+}
+  
+//------------------------------------------------------------------------------
+  
 State const* GraphParticles::GetMinDisbeliefState(View view, int x, int y) const
 {
   Node const* node = nodes[view].Get(x, y);
@@ -355,11 +658,40 @@ float GraphParticles::GetMaxDisbelief(View view, int x, int y) const
   
 void GraphParticles::UpdateCurrentDisbelief(View view, int x, int y)
 {
+  PMBP_TIME_PHASE(kUpdateDisbelief);
+  
   Node* node = nodes[view].Get(x, y);
+  int size = node->Size();
   
-  for(int k=0; k<node->Size(); ++k){
-    State const * particle = node->GetParticle(k);
-    node->SetParticleValue(k, EvaluateDisbelief(view, x, y, *particle));
+  // Sum the incoming messages for all the particles at once
+  std::vector<float>& message_sum = visit_message_sum;
+  std::vector<float>& messages = visit_messages;
+  message_sum.assign(size, 0.f);
+  messages.resize(size);
+  
+  if(x>0){
+    EvaluateMessages(view, x-1, y, x, y, &messages[0]);
+    for(int k=0; k<size; ++k) message_sum[k] += messages[k];
+  }
+  
+  if(y>0){
+    EvaluateMessages(view, x, y-1, x, y, &messages[0]);
+    for(int k=0; k<size; ++k) message_sum[k] += messages[k];
+  }
+  
+  if(x<w[view]-1){
+    EvaluateMessages(view, x+1, y, x, y, &messages[0]);
+    for(int k=0; k<size; ++k) message_sum[k] += messages[k];
+  }
+  
+  if(y<h[view]-1){
+    EvaluateMessages(view, x, y+1, x, y, &messages[0]);
+    for(int k=0; k<size; ++k) message_sum[k] += messages[k];
+  }
+  
+  for(int k=0; k<size; ++k){
+    float unary = ParticleUnaryEnergy(view, x, y, k);
+    node->SetParticleValue(k, unary + message_sum[k]);
   }
 }
 
@@ -373,8 +705,9 @@ Image GraphParticles::OutputMotionField(View view) const
   float minx =  9999, miny =  9999;
   float maxrad = -1;
   
-  for(int i=0; i<output.width; ++i){
-    for(int j=0; j<output.height; ++j){
+  // Nodes by rows, which streams a paged field
+  for(int j=0; j<output.height; ++j){
+    for(int i=0; i<output.width; ++i){
       
       float dx, dy;
       State const* state = GetMinDisbeliefState(view, i, j);
@@ -395,8 +728,8 @@ Image GraphParticles::OutputMotionField(View view) const
   if (maxrad == 0) // if flow == 0 everywhere
     maxrad = 1;
   
-  for(int i=0; i<output.width; ++i){
-    for(int j=0; j<output.height; ++j){
+  for(int j=0; j<output.height; ++j){
+    for(int i=0; i<output.width; ++i){
       
       float dx, dy;
       State const* state = GetMinDisbeliefState(view, i, j);
@@ -446,8 +779,9 @@ Image GraphParticles::OutputReconstruction(View view) const
     }
   }
   
-  for(int i=0; i<reconstructed.width; ++i){
-    for(int j=0; j<reconstructed.height; ++j){
+  // Nodes by rows, which streams a paged field
+  for(int j=0; j<reconstructed.height; ++j){
+    for(int i=0; i<reconstructed.width; ++i){
       
       float dx, dy;
       State const* state = GetMinDisbeliefState(view, i, j);
@@ -516,8 +850,8 @@ Flo* GraphParticles::ExportFlo(View view) const
 {
   Flo* flo = new Flo(w[view], h[view]);
   
-  for(int i=0; i<w[view]; ++i){
-    for(int j=0; j<h[view]; ++j){
+  for(int j=0; j<h[view]; ++j){
+    for(int i=0; i<w[view]; ++i){
       
       float dx, dy;
       State const* state = GetMinDisbeliefState(view, i, j);
@@ -532,6 +866,28 @@ Flo* GraphParticles::ExportFlo(View view) const
   
 //------------------------------------------------------------------------------
   
+void GraphParticles::ExportDisplacement(View view, float* buffer, int stride, int n_channels) const
+{
+  // Rows are stride floats apart, each pixel holding dx, then dy if
+  // n_channels is 2 (dx alone being the disparity in stereo)
+  for(int j=0; j<h[view]; ++j){
+    float* row = buffer + j*stride;
+    
+    for(int i=0; i<w[view]; ++i){
+      float dx, dy;
+      State const* state = GetMinDisbeliefState(view, i, j);
+      GetDisplacement(i, j, *state, dx, dy);
+      
+      row[n_channels*i] = dx;
+      if(n_channels > 1){
+        row[n_channels*i+1] = dy;
+      }
+    }
+  }
+}
+  
+//------------------------------------------------------------------------------
+  
 Image GraphParticles::OutputUnaryEnergy(View view, float& energy) const
 {
   energy = 0.f;
@@ -539,12 +895,18 @@ Image GraphParticles::OutputUnaryEnergy(View view, float& energy) const
   Field<float> field(w[view], h[view], 1);
   float max_energy = 0;
   
+  // Nodes by rows, which streams a paged field, then the sum by columns
+  for(int j=0; j<h[view]; ++j){
+    for(int i=0; i<w[view]; ++i){
+      State const* state = GetMinDisbeliefState(view, i, j);
+      field[i][j][0] = UnaryEnergy(view, i, j, *state, infinity);
+    }
+  }
+  
   for(int i=0; i<w[view]; ++i){
     for(int j=0; j<h[view]; ++j){
-      State const* state = GetMinDisbeliefState(view, i, j);
-      float e = UnaryEnergy(view, i, j, *state, infinity);
+      float e = field[i][j][0];
       energy += e;
-      field[i][j][0] = e;
       
       if(max_energy < e){
         max_energy = e;
@@ -566,6 +928,26 @@ Image GraphParticles::OutputUnaryEnergy(View view, float& energy) const
   
 //------------------------------------------------------------------------------
   
+const Instrumentation& GraphParticles::GetInstrumentation() const
+{
+  return instrumentation;
+}
+
+//------------------------------------------------------------------------------
+
+float GraphParticles::GetNodeBytes(View view) const
+{
+  size_t bytes = 0;
+  for(int j=0; j<h[view]; ++j){
+    for(int i=0; i<w[view]; ++i){
+      bytes += nodes[view].Get(i, j)->Bytes();
+    }
+  }
+  return float(bytes)/std::max(w[view]*h[view], 1);
+}
+
+//------------------------------------------------------------------------------
+
 Image GraphParticles::OutputPairwiseEnergy(View view, float& energy) const
 {
   energy = 0.f;
@@ -573,8 +955,9 @@ Image GraphParticles::OutputPairwiseEnergy(View view, float& energy) const
   Field<float> field(w[view], h[view], 1);
   float max_energy = 0;
   
-  for(int i=0; i<w[view]; ++i){
-    for(int j=0; j<h[view]; ++j){
+  // Nodes by rows, which streams a paged field, then the sum by columns
+  for(int j=0; j<h[view]; ++j){
+    for(int i=0; i<w[view]; ++i){
       State const* state = GetMinDisbeliefState(view, i, j);
       
       float e = 0;
@@ -595,8 +978,14 @@ Image GraphParticles::OutputPairwiseEnergy(View view, float& energy) const
         e += PairwiseEnergy(view, i, j, *state, i, j+1, *GetMinDisbeliefState(view, i, j+1));
       }
       
-      energy += e;
       field[i][j][0] = e;
+    }
+  }
+  
+  for(int i=0; i<w[view]; ++i){
+    for(int j=0; j<h[view]; ++j){
+      float e = field[i][j][0];
+      energy += e;
       
       if(max_energy < e){
         max_energy = e;
@@ -626,116 +1015,483 @@ void GraphParticles::ImportFields(const std::string& filename){
   std::cout << "Importing: " << filename << std::endl;
   
   std::fstream fs(filename.c_str(), std::ios::in | std::ios::binary);
+  Clock clock;
   
-  // Read the tag
-  char tag;
+  mapped_fields.Close();
+  mapped_chunks[kOne].clear();
+  mapped_chunks[kTwo].clear();
+  
+  // Files without the magic have the original layout
+  char magic[4] = {0, 0, 0, 0};
+  fs.read(magic, 4);
+  
+  if(memcmp(magic, kFieldsMagic, 4) != 0){
+    fs.clear();
+    fs.seekg(0);
+    ImportLegacyFields(fs);
+    std::cout << "Initialisation OK! (" << clock.Poll() << "s)" << std::endl;
+    return;
+  }
+  
+  // Header, read aside until it is checked against the graph
+  int version = 0;
+  int n_views = 0;
+  int compression = 0;
+  int rows_per_chunk = 0;
+  int file_data_dim = 0;
+  int file_meta_dim = 0;
+  int n_particles = 0;
+  char tag = 0;
+  fs.read((char*)&version, sizeof(version));
   fs.read(&tag, 1);
   
+  // From version 3 the header is padded to keep the particles 4-byte aligned
+  if(version >= 3){
+    char padding[3];
+    fs.read(padding, 3);
+  }
+  fs.read((char*)&file_data_dim, sizeof(file_data_dim));
+  fs.read((char*)&file_meta_dim, sizeof(file_meta_dim));
+  fs.read((char*)&n_particles, sizeof(n_particles));
+  fs.read((char*)&n_views, sizeof(n_views));
+  fs.read((char*)&compression, sizeof(compression));
+  fs.read((char*)&rows_per_chunk, sizeof(rows_per_chunk));
+  
+  std::cout << "Importing match field version " << version << " with dim [" << file_data_dim << "," << file_meta_dim << "] and " << n_particles << " particles" << std::endl;
+  
+  bool valid = fs && version >= 1 && n_views >= 1 && rows_per_chunk > 0 && (compression == kFieldsNone || compression == kFieldsZlib);
+  
+  // A file of another application, or a corrupted header, leaves the setup
+  // of the graph unchanged
+  if(!valid || !CheckFieldsHeader(tag, file_data_dim, file_meta_dim, n_particles)){
+    std::cerr << "Error: " << filename << " does not hold fields of this application, starting from scratch" << std::endl;
+    for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+      InitialiseFields((View)view);
+      InitialiseNodes((View)view);
+    }
+    return;
+  }
+  
+  parameters.n_particles = n_particles;
+  
+  // Uncompressed files are mapped, and their rows copied when first needed
+  if(version >= 3 && version <= kFieldsVersion && compression == kFieldsNone && fs && mapped_fields.Open(filename)){
+    size_t offset = fs.tellg();
+    
+    for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+      bool success = view < n_views && MapFieldsView((View)view, rows_per_chunk, offset);
+      
+      if(!success){
+        std::cerr << "Error: could not import view " << view << " from " << filename << std::endl;
+        mapped_chunks[view].clear();
+        InitialiseFields((View)view);
+        InitialiseNodes((View)view);
+      }
+    }
+    
+    std::cout << "Mapped " << mapped_fields.Size() << " bytes (" << clock.Poll() << "s)" << std::endl;
+    return;
+  }
+  
+  for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+    bool success = fs && version <= kFieldsVersion && view < n_views;
+    
+    if(success){
+      success = ImportFieldsView(fs, (View)view, compression, rows_per_chunk);
+    }
+    
+    // Start the view from scratch rather than from a partial import
+    if(!success){
+      std::cerr << "Error: could not import view " << view << " from " << filename << std::endl;
+      InitialiseFields((View)view);
+      InitialiseNodes((View)view);
+    }
+  }
+  
+  std::cout << "Initialisation OK! (" << clock.Poll() << "s)" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+
+bool GraphParticles::ImportFieldsView(std::istream& fs, View view, int compression, int rows_per_chunk)
+{
   int www = 0;
   int hhh = 0;
-  
-  // Read state dimensions
-  fs.read((char*)&data_dim, sizeof(data_dim));
-  fs.read((char*)&meta_dim, sizeof(meta_dim));
-  // Read image dimensions
   fs.read((char*)&www, sizeof(www));
   fs.read((char*)&hhh, sizeof(hhh));
-  // Read number of particles
-  fs.read((char*)&parameters.n_particles, sizeof(parameters.n_particles));
-
-  std::cout << "Importing match field with dim [" << data_dim << "," << meta_dim << "] and size [" << www << "," << hhh << "] with " << parameters.n_particles << " particles" << std::endl;
-  
-  for(int i=0; i<www; ++i){
-    for(int j=0; j<hhh; ++j){
-      for(int k=0; k<parameters.n_particles; ++k){
-        State state(data_dim, meta_dim);
-        fs.read((char*)&state.data[0], data_dim*sizeof(state.data[0]));
-        fs.read((char*)&state.meta[0], meta_dim*sizeof(state.meta[0]));
-        nodes[kOne].Set(i, j, 0, Node(parameters.n_particles));
-        nodes[kOne].Get(i,j)->InitialiseFoundation();
-        nodes[kOne].Get(i, j)->SetParticle(k, state, 0);
+  
+  if(!fs || www != w[view] || hhh != h[view]){
+    return false;
+  }
+  
+  // Nodes of the size given by the file
+  if(nodes[view].Width() != www || nodes[view].Get(0, 0)->Size() != parameters.n_particles){
+    InitialiseFields(view);
+  }
+  
+  int particle_size = parameters.n_particles*(data_dim+meta_dim);
+  std::vector<float> raw;
+  std::vector<char> stored;
+  
+  // One read per chunk, then the particles are copied from memory
+  for(int y_first=0; y_first<hhh; y_first+=rows_per_chunk){
+    int y_last = std::min(y_first+rows_per_chunk, hhh);
+    
+    int raw_size, stored_size;
+    unsigned int checksum;
+    fs.read((char*)&raw_size, sizeof(raw_size));
+    fs.read((char*)&stored_size, sizeof(stored_size));
+    fs.read((char*)&checksum, sizeof(checksum));
+    
+    if(!fs || raw_size != (y_last-y_first)*www*particle_size*sizeof(float)){
+      return false;
+    }
+    
+    // Compressed chunks are no larger than zlib's bound
+    if(compression == kFieldsZlib ? (stored_size < 0 || stored_size > compressBound(raw_size)) : stored_size != raw_size){
+      return false;
+    }
+    
+    raw.resize(raw_size/sizeof(float));
+    
+    if(compression == kFieldsZlib){
+      stored.resize(stored_size);
+      fs.read(&stored[0], stored_size);
+      
+      uLongf size = raw_size;
+      if(uncompress((Bytef*)&raw[0], &size, (const Bytef*)&stored[0], stored_size) != Z_OK || size != raw_size){
+        return false;
+      }
+    }else{
+      fs.read((char*)&raw[0], raw_size);
+    }
+    
+    if(!fs || crc32(0, (const Bytef*)&raw[0], raw_size) != checksum){
+      return false;
+    }
+    
+    for(int y=y_first; y<y_last; ++y){
+      for(int x=0; x<www; ++x){
+        SetParticles(nodes[view].Get(x, y), &raw[((y-y_first)*www+x)*particle_size]);
       }
     }
   }
   
-  if(parameters.bidirectional)
-  {
-    fs.read((char*)&www, sizeof(www));
-    fs.read((char*)&hhh, sizeof(hhh));
-    
-    // Right
-    for(int i=0; i<www; ++i){
-      for(int j=0; j<hhh; ++j){
-        for(int k=0; k<parameters.n_particles; ++k){
-          State state(data_dim, meta_dim);
-          fs.read((char*)&state.data[0], data_dim*sizeof(state.data[0]));
-          fs.read((char*)&state.meta[0], meta_dim*sizeof(state.meta[0]));
-          nodes[kTwo].Set(i, j, 0, Node(parameters.n_particles));
-          nodes[kTwo].Get(i,j)->InitialiseFoundation();
-          nodes[kTwo].Get(i, j)->SetParticle(k, state, 0);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool GraphParticles::MapFieldsView(View view, int rows_per_chunk, size_t& offset)
+{
+  int size[2];
+  if(offset+sizeof(size) > mapped_fields.Size()){
+    return false;
+  }
+  memcpy(size, mapped_fields.Data()+offset, sizeof(size));
+  
+  if(size[0] != w[view] || size[1] != h[view]){
+    return false;
+  }
+  
+  if(nodes[view].Width() != w[view] || nodes[view].Get(0, 0)->Size() != parameters.n_particles){
+    InitialiseFields(view);
+  }
+  
+  // Chunks all have the same size but the last one, so that a row is found
+  // without reading the chunks before it
+  int n_chunks = (h[view]+rows_per_chunk-1)/rows_per_chunk;
+  size_t row_size = w[view]*parameters.n_particles*(data_dim+meta_dim)*sizeof(float);
+  size_t end = offset + 2*sizeof(int) + n_chunks*3*sizeof(int) + h[view]*row_size;
+  
+  if(end > mapped_fields.Size()){
+    return false;
+  }
+  
+  mapped_offsets[view] = offset + 2*sizeof(int);
+  mapped_rows_per_chunk = rows_per_chunk;
+  mapped_chunks[view].assign(n_chunks, false);
+  offset = end;
+  
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::FaultInRows(View view, int y_first, int y_last)
+{
+  if(mapped_chunks[view].empty()){
+    return;
+  }
+  
+  y_first = std::max(y_first, 0);
+  y_last = std::min(y_last, h[view]);
+  
+  int particle_size = parameters.n_particles*(data_dim+meta_dim);
+  size_t chunk_size = 3*sizeof(int) + mapped_rows_per_chunk*w[view]*particle_size*sizeof(float);
+  
+  for(int c=y_first/mapped_rows_per_chunk; c<=(y_last-1)/mapped_rows_per_chunk; ++c){
+    if(mapped_chunks[view][c]){
+      continue;
+    }
+    mapped_chunks[view][c] = true;
+    
+    const char* chunk = mapped_fields.Data() + mapped_offsets[view] + c*chunk_size;
+    int chunk_first = c*mapped_rows_per_chunk;
+    int chunk_last = std::min(chunk_first+mapped_rows_per_chunk, h[view]);
+    
+    int raw_size, stored_size;
+    unsigned int checksum;
+    memcpy(&raw_size, chunk, sizeof(raw_size));
+    memcpy(&stored_size, chunk+sizeof(int), sizeof(stored_size));
+    memcpy(&checksum, chunk+2*sizeof(int), sizeof(checksum));
+    
+    const float* raw = (const float*)(chunk + 3*sizeof(int));
+    bool valid = raw_size == (chunk_last-chunk_first)*w[view]*particle_size*sizeof(float) && stored_size == raw_size && crc32(0, (const Bytef*)raw, raw_size) == checksum;
+    
+    if(!valid){
+      std::cerr << "Error: corrupted rows [" << chunk_first << "," << chunk_last << ") of view " << view << " in the imported fields" << std::endl;
+    }
+    
+    for(int y=chunk_first; y<chunk_last; ++y){
+      for(int x=0; x<w[view]; ++x){
+        if(valid){
+          SetParticles(nodes[view].Get(x, y), &raw[((y-chunk_first)*w[view]+x)*particle_size]);
+        }else{
+          InitialiseNode(view, x, y);
         }
       }
     }
   }
   
-  fs.close();
+  // Release the file once all of it has been copied
+  for(int view=kOne; view<=kTwo; ++view){
+    if(std::find(mapped_chunks[view].begin(), mapped_chunks[view].end(), false) != mapped_chunks[view].end()){
+      return;
+    }
+  }
   
-  std::cout << "Initialisation OK!" << std::endl;
+  mapped_chunks[kOne].clear();
+  mapped_chunks[kTwo].clear();
+  mapped_fields.Close();
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::FaultInAll()
+{
+  FaultInRows(kOne, 0, h[kOne]);
+  FaultInRows(kTwo, 0, h[kTwo]);
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::ImportLegacyFields(std::istream& fs)
+{
+  // Header, read aside until it is checked against the graph
+  char tag = 0;
+  int file_data_dim = 0;
+  int file_meta_dim = 0;
+  int n_particles = 0;
+  int www = 0;
+  int hhh = 0;
+  
+  fs.read(&tag, 1);
+  // Read state dimensions
+  fs.read((char*)&file_data_dim, sizeof(file_data_dim));
+  fs.read((char*)&file_meta_dim, sizeof(file_meta_dim));
+  // Read image dimensions
+  fs.read((char*)&www, sizeof(www));
+  fs.read((char*)&hhh, sizeof(hhh));
+  // Read number of particles
+  fs.read((char*)&n_particles, sizeof(n_particles));
+
+  std::cout << "Importing match field with dim [" << file_data_dim << "," << file_meta_dim << "] and size [" << www << "," << hhh << "] with " << n_particles << " particles" << std::endl;
+  
+  bool valid = fs && CheckFieldsHeader(tag, file_data_dim, file_meta_dim, n_particles);
+  if(valid){
+    parameters.n_particles = n_particles;
+  }
+  
+  int particle_size = parameters.n_particles*(data_dim+meta_dim);
+  std::vector<float> columns;
+  
+  for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+    if(view == kTwo && valid){
+      fs.read((char*)&www, sizeof(www));
+      fs.read((char*)&hhh, sizeof(hhh));
+    }
+    
+    valid = valid && fs && www == w[view] && hhh == h[view];
+    
+    InitialiseFields((View)view);
+    
+    // Particles are stored column by column. A paged field is filled one
+    // band of rows at a time, reading the part of each column in the band,
+    // so that each band is only created once. Otherwise all the rows are
+    // read in one pass.
+    if(valid){
+      std::streampos view_start = fs.tellg();
+      int band_rows = nodes[view].IsPaged() ? parameters.band_rows : hhh;
+    
+      for(int first=0; first<hhh && valid; first+=band_rows){
+        int n_rows = std::min(band_rows, hhh-first);
+        columns.resize(www*n_rows*particle_size);
+    
+        for(int i=0; i<www && valid; ++i){
+          fs.seekg(view_start + std::streamoff((size_t(i)*hhh + first)*particle_size*sizeof(float)));
+          fs.read((char*)&columns[i*n_rows*particle_size], n_rows*particle_size*sizeof(float));
+          valid = !!fs;
+        }
+    
+        for(int j=0; j<n_rows && valid; ++j){
+          for(int i=0; i<www; ++i){
+            SetParticles(nodes[view].Get(i, first+j), &columns[(i*n_rows + j)*particle_size]);
+          }
+        }
+      }
+    
+      // The next view follows the last column
+      fs.seekg(view_start + std::streamoff(size_t(www)*hhh*particle_size*sizeof(float)));
+    }
+    
+    // Start the view, and the ones after it, from scratch
+    if(!valid){
+      std::cerr << "Error: could not import view " << view << ", starting it from scratch" << std::endl;
+      InitialiseFields((View)view);
+      InitialiseNodes((View)view);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+bool GraphParticles::CheckFieldsHeader(char tag, int file_data_dim, int file_meta_dim, int n_particles)
+{
+  return tag == GetTag() && file_data_dim == data_dim && file_meta_dim == meta_dim && CanImportParticles(n_particles);
+}
+
+//------------------------------------------------------------------------------
+
+bool GraphParticles::CanImportParticles(int n_particles) const
+{
+  return n_particles > 0 && n_particles <= kFieldsMaxParticles;
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::SetParticles(Node* node, const float* particles) const
+{
+  // Assigning into the same state reuses the storage of the particles
+  State state(data_dim, meta_dim);
+  
+  for(int k=0; k<parameters.n_particles; ++k){
+    std::copy(particles, particles+data_dim, state.data.begin());
+    std::copy(particles+data_dim, particles+data_dim+meta_dim, state.meta.begin());
+    node->SetParticle(k, state, 0);
+    particles += data_dim+meta_dim;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void GraphParticles::GetParticles(const Node* node, float* particles) const
+{
+  for(int k=0; k<parameters.n_particles; ++k){
+    State const* state = node->GetParticle(k);
+    std::copy(state->data.begin(), state->data.end(), particles);
+    std::copy(state->meta.begin(), state->meta.end(), particles+data_dim);
+    particles += data_dim+meta_dim;
+  }
 }
 
 //------------------------------------------------------------------------------
 
 void GraphParticles::ExportFields(const std::string& filename){
   std::fstream fs(filename.c_str(), std::ios::out | std::ios::binary);
+  Clock clock;
+  ExportFields(fs);
+  fs.close();
+  std::cout << "Exported " << filename << " (" << clock.Poll() << "s)" << std::endl;
+}
   
+//------------------------------------------------------------------------------
+
+void GraphParticles::ExportFields(std::ostream& fs){
+  int version = kFieldsVersion;
+  int n_views = parameters.bidirectional ? 2 : 1;
+  int compression = parameters.fields_compression;
+  int rows_per_chunk = kFieldsRowsPerChunk;
   char tag = GetTag();
   
-  // Export application specific tag
-  fs.write(&tag, sizeof(tag));
+  // Particles are written from the imported file if not copied yet
+  FaultInAll();
   
-  // Export state dimensions
+  // Header, with the application specific tag padded to 4 bytes
+  char padding[3] = {0, 0, 0};
+  fs.write(kFieldsMagic, 4);
+  fs.write((char*)&version, sizeof(version));
+  fs.write(&tag, sizeof(tag));
+  fs.write(padding, 3);
   fs.write((char*)&data_dim, sizeof(data_dim));
   fs.write((char*)&meta_dim, sizeof(meta_dim));
-  
-  // Export w and h
-  fs.write((char*)&w[kOne], sizeof(w[kOne]));
-  fs.write((char*)&h[kOne], sizeof(h[kOne]));
-
-  // Export number of particles
   fs.write((char*)&parameters.n_particles, sizeof(parameters.n_particles));
+  fs.write((char*)&n_views, sizeof(n_views));
+  fs.write((char*)&compression, sizeof(compression));
+  fs.write((char*)&rows_per_chunk, sizeof(rows_per_chunk));
   
   std::cout << "Exporting match field with dim [" << data_dim << "," << meta_dim << "] and  size [" << w[kOne] << "," << h[kOne] << "] with " << parameters.n_particles << " particles" << std::endl;
   
-  for(int i=0; i<w[kOne]; ++i){
-    for(int j=0; j<h[kOne]; ++j){
-      for(int k=0; k<parameters.n_particles; ++k){
-        State const* state = nodes[kOne].Get(i, j)->GetParticle(k);
-        fs.write((char*)&state->data[0], data_dim*sizeof(state->data[0]));
-        fs.write((char*)&state->meta[0], meta_dim*sizeof(state->meta[0]));
-      }
-    }
+  for(int view=kOne; view<n_views; ++view){
+    ExportFieldsView(fs, (View)view, compression, rows_per_chunk);
   }
+}
+
+//------------------------------------------------------------------------------
 
-  if(parameters.bidirectional){
-    fs.write((char*)&w[kOne], sizeof(w[kTwo]));
-    fs.write((char*)&h[kOne], sizeof(h[kTwo]));
+void GraphParticles::ExportFieldsView(std::ostream& fs, View view, int compression, int rows_per_chunk) const
+{
+  fs.write((char*)&w[view], sizeof(w[view]));
+  fs.write((char*)&h[view], sizeof(h[view]));
+  
+  int particle_size = parameters.n_particles*(data_dim+meta_dim);
+  std::vector<float> raw;
+  std::vector<char> stored;
+  
+  // Rows are gathered in memory and written one chunk at a time
+  for(int y_first=0; y_first<h[view]; y_first+=rows_per_chunk){
+    int y_last = std::min(y_first+rows_per_chunk, h[view]);
     
-    std::cout << "Exporting match field with size " << w[kTwo] << "," << h[kTwo] << std::endl;
+    raw.resize((y_last-y_first)*w[view]*particle_size);
+    for(int y=y_first; y<y_last; ++y){
+      for(int x=0; x<w[view]; ++x){
+        GetParticles(nodes[view].Get(x, y), &raw[((y-y_first)*w[view]+x)*particle_size]);
+      }
+    }
     
-    for(int i=0; i<w[kTwo]; ++i){
-      for(int j=0; j<h[kTwo]; ++j){
-        for(int k=0; k<parameters.n_particles; ++k){
-          State const* state = nodes[kTwo].Get(i, j)->GetParticle(k);
-          fs.write((char*)&state->data[0], data_dim*sizeof(state->data[0]));
-          fs.write((char*)&state->meta[0], meta_dim*sizeof(state->meta[0]));
-        }
+    int raw_size = raw.size()*sizeof(float);
+    unsigned int checksum = crc32(0, (const Bytef*)&raw[0], raw_size);
+    const char* data = (const char*)&raw[0];
+    int stored_size = raw_size;
+    
+    if(compression == kFieldsZlib){
+      uLongf size = compressBound(raw_size);
+      stored.resize(size);
+      if(compress2((Bytef*)&stored[0], &size, (const Bytef*)&raw[0], raw_size, 1) != Z_OK){
+        throw std::runtime_error("could not compress the fields");
       }
+      data = &stored[0];
+      stored_size = size;
     }
+    
+    fs.write((char*)&raw_size, sizeof(raw_size));
+    fs.write((char*)&stored_size, sizeof(stored_size));
+    fs.write((char*)&checksum, sizeof(checksum));
+    fs.write(data, stored_size);
   }
-  
-  fs.close();
 }
-  
+
+
 //------------------------------------------------------------------------------
 
 void GraphParticles::GetDirections(int k, View view, int& i_first, int& i_last, int& j_first, int& j_last, int& i_incr, int& j_incr) const
@@ -758,39 +1514,17 @@ void GraphParticles::GetDirections(int k, View view, int& i_first, int& i_last,
 
 //------------------------------------------------------------------------------
 
-void GraphParticles::Inspect(){
-  
-  Image flow = OutputMotionField(kOne);
-  CImg<unsigned char> cflow = ImageToCImg(flow);
-  
-  CImg<unsigned char> one = ImageToCImg(*images[kOne]);
-  CImgDisplay visualisation_one(one, "Inspect - One");
-  CImgDisplay visualisation_flow(cflow, "Inspect - Flow");
-  
-  while (!visualisation_flow.is_closed()) {
-    
-    CImgDisplay::wait_all();
-    
-    if(visualisation_one.button()) {
-      const int x = visualisation_flow.mouse_x();
-      const int y = visualisation_flow.mouse_y();
-      State const * state = GetMinDisbeliefState(kOne, x, y);
-      std::cout << "At [" << x << "," << y << "]: " << nodes[kOne].Get(x, y)->Summary() << std::endl;
-      std::cout << "Best displacement at [" << x << "," << y << "]: " << "[" << state->data[0] << "," << state->data[1] << "] with disbelief: " << nodes[kOne].Get(x, y)->GetMinValue() << endl;
-    }
-    
-    
-    if(visualisation_flow.button()) {
-      const int x = visualisation_flow.mouse_x();
-      const int y = visualisation_flow.mouse_y();
-      State const * state = GetMinDisbeliefState(kOne, x, y);
-      std::cout << "At [" << x << "," << y << "]: " << nodes[kOne].Get(x, y)->Summary() << std::endl;
-      std::cout << "Best displacement at [" << x << "," << y << "]: " << "[" << state->data[0] << "," << state->data[1] << "] with disbelief: " << nodes[kOne].Get(x, y)->GetMinValue() << endl;
-    }
-  }  
+std::string GraphParticles::Describe(View view, int x, int y) const
+{
+  State const * state = GetMinDisbeliefState(view, x, y);
+  std::stringstream ss;
+  ss << "At [" << x << "," << y << "]: " << nodes[view].Get(x, y)->Summary() << std::endl;
+  ss << "Best displacement at [" << x << "," << y << "]: " << "[" << state->data[0] << "," << state->data[1] << "] with disbelief: " << nodes[view].Get(x, y)->GetMinValue() << endl;
+  return ss.str();
 }
 
-  
+//------------------------------------------------------------------------------
+
 //------------------------------------------------------------------------------
 
 }
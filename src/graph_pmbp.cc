@@ -30,8 +30,8 @@ void GraphPmbp::InitialiseNode(View view, int x, int y)
 {
   // For each particle, initialise randomly
   for(int k=0; k<parameters.n_particles; ++k){
-    State state = GetRandomState(view, x, y);
-    nodes[view].Get(x, y)->SetParticle(k, state, 0);
+    GetRandomState(view, x, y, candidate);
+    nodes[view].Get(x, y)->SetParticle(k, candidate, 0);
   }
 }
 
@@ -41,7 +41,13 @@ void GraphPmbp::Update(View view, int x, int y)
 {
   // Generate candidate particles and refine the particle set of the node
   
-  // First propagate from all the neighbours
+  // After a warm start, try the previous state carried by the motion
+  if(warm_started && iteration == 0){
+    GetWarmStartState(view, x, y, candidate);
+    ProposeCandidate(view, x, y, candidate);
+  }
+  
+  // Propagate from all the neighbours
   Propagate(view, x, y);
   
   // Then perform random search
@@ -52,25 +58,26 @@ void GraphPmbp::Update(View view, int x, int y)
   
 void GraphPmbp::Propagate(View view, int x, int y)
 {
+  PMBP_TIME_PHASE(kPropagate);
   
   if(x>0 && processed[view].Get(x-1, y) ){
-    State state = GetStateFromNeighbour(view, x, y, x-1, y);
-    ProposeCandidate(view, x, y, state);
+    GetStateFromNeighbour(view, x, y, x-1, y, candidate);
+    ProposeCandidate(view, x, y, candidate);
   }
   
   if(y>0 && processed[view].Get(x, y-1) ){
-    State state = GetStateFromNeighbour(view, x, y, x, y-1);
-    ProposeCandidate(view, x, y, state);
+    GetStateFromNeighbour(view, x, y, x, y-1, candidate);
+    ProposeCandidate(view, x, y, candidate);
   }
   
   if(x<w[view]-1 && processed[view].Get(x+1, y) ){
-    State state = GetStateFromNeighbour(view, x, y, x+1, y);
-    ProposeCandidate(view, x, y, state);
+    GetStateFromNeighbour(view, x, y, x+1, y, candidate);
+    ProposeCandidate(view, x, y, candidate);
   }
     
   if(y<h[view]-1 && processed[view].Get(x, y+1) ){
-    State state = GetStateFromNeighbour(view, x, y, x, y+1);
-    ProposeCandidate(view, x, y, state);
+    GetStateFromNeighbour(view, x, y, x, y+1, candidate);
+    ProposeCandidate(view, x, y, candidate);
   }
 }
 
@@ -78,6 +85,8 @@ void GraphPmbp::Propagate(View view, int x, int y)
   
 void GraphPmbp::Randomise(View view, int x, int y)
 {
+  PMBP_TIME_PHASE(kRandomise);
+  
   Node* node = nodes[view].Get(x, y, 0);
   size_t size = node->Size();
   for(int k=0; k<size; ++k){
@@ -86,8 +95,8 @@ void GraphPmbp::Randomise(View view, int x, int y)
     // Another option is to get the current best inside the following while
     State const* current = node->GetParticle(k);
     while(ratio > 0.001f){
-      State state = GetRandomStateAround(view, x, y, *current, ratio);
-      ProposeCandidate(view, x, y, state);
+      GetRandomStateAround(view, x, y, *current, ratio, candidate);
+      ProposeCandidate(view, x, y, candidate);
       
       ratio /= 2.f;
     }
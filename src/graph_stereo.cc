@@ -33,6 +33,12 @@ float GraphStereo::UnaryEnergy(View view, int x, int y, const State& state, floa
   if(!image_operator->IsStateValid(view, x, y, state))
     return parameters.infinity;
   
+  // Use the kernel specialised for horizontal displacements, unless another
+  // traversal of the patch was requested
+  if(parameters.rectified && !parameters.ordered_patch && !parameters.incremental_patch){
+    return image_operator->RectifiedPatchCost(view, x, y, state.data[0], state.data[1], state.data[2], threshold);
+  }
+  
   return image_operator->PatchCost(view, x, y, state, threshold);
 }
 
@@ -62,9 +68,10 @@ float GraphStereo::PairwiseEnergy(View view, int x1, int y1, const State& state1
   
 //------------------------------------------------------------------------------
   
-State GraphStereo::GetStateFromParametrization(float x, float y, float nx, float ny, float nz, float d) const{
+void GraphStereo::GetStateFromParametrization(float x, float y, float nx, float ny, float nz, float d, State& state) const{
   
-  State state(data_dim, meta_dim);
+  state.data.resize(data_dim);
+  state.meta.resize(meta_dim);
   
   state.data[0] = - 1.f * nx / nz;
   state.data[1] = - 1.f * ny / nz;
@@ -74,13 +81,11 @@ State GraphStereo::GetStateFromParametrization(float x, float y, float nx, float
   state.meta[1] = ny;
   state.meta[2] = nz;
   state.meta[3] = d;
-  
-  return state;
 }
   
 //------------------------------------------------------------------------------
   
-State GraphStereo::GetRandomState(View view, int x, int y) const
+void GraphStereo::GetRandomState(View view, int x, int y, State& state) const
 {
   // Use the maximum dimension unless max_motion is set to 0
   float max_motion = (parameters.max_motion==0.f?std::max(w[view], h[view]):parameters.max_motion);
@@ -104,12 +109,12 @@ State GraphStereo::GetRandomState(View view, int x, int y) const
   ny /= length;
   nz /= length;
   
-  return GetStateFromParametrization(x, y, nx, ny, nz, d);
+  GetStateFromParametrization(x, y, nx, ny, nz, d, state);
 }
   
 //------------------------------------------------------------------------------
   
-State GraphStereo::GetRandomStateAround(View view, int x, int y, const State& current, float ratio) const
+void GraphStereo::GetRandomStateAround(View view, int x, int y, const State& current, float ratio, State& state) const
 {
   // Use the maximum dimension unless max_motion is set to 0
   float max_motion = (parameters.max_motion==0.f?std::max(w[view], h[view]):parameters.max_motion);
@@ -136,15 +141,15 @@ State GraphStereo::GetRandomStateAround(View view, int x, int y, const State& cu
   ny /= length;
   nz /= length;
   
-  return GetStateFromParametrization(x, y, nx, ny, nz, d);
+  GetStateFromParametrization(x, y, nx, ny, nz, d, state);
 }
 
 //------------------------------------------------------------------------------
   
-State GraphStereo::GetStateFromNeighbour(View view, int x, int y, int nx, int ny) const
+void GraphStereo::GetStateFromNeighbour(View view, int x, int y, int nx, int ny, State& state) const
 {
   // Retrieve best state of the neighbour
-  return GetMinDisbeliefState(view, nx, ny)->Copy();
+  state = *GetMinDisbeliefState(view, nx, ny);
 }
   
 //------------------------------------------------------------------------------
@@ -1,20 +1,150 @@
 #include "image.h"
+#include "thread_pool.h"
 
 #include <vector>
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 
-#include <CImg.h>
-using namespace cimg_library;
-
 //------------------------------------------------------------------------------
 
 namespace pmbp{
   
+//------------------------------------------------------------------------------
+
+namespace{
+  
+// Two level histograms of the median filter
+const int kCoarseBins = 16;
+const int kFineBins = 256;
+const int kFineBinsPerCoarse = kFineBins/kCoarseBins;
+  
+}
+  
+//------------------------------------------------------------------------------
+  
+// Column histograms are slid down the rows and the kernel histogram along the
+// columns, the fine level of each coarse bin being only brought up to date
+// when the median falls in it (Perreault and Hebert, "Median Filtering in
+// Constant Time").
+void Image::MedianFilterBand(const unsigned char* in, unsigned char* out, int width, int height, int r, int start_y, int end_y)
+{
+  std::vector<unsigned short> column_coarse(width*kCoarseBins, 0);
+  std::vector<unsigned short> column_fine(width*kFineBins, 0);
+  
+  int kernel_coarse[kCoarseBins];
+  int kernel_fine[kFineBins];
+  
+  // Columns [fine_start, fine_end) held by the fine level of each coarse bin
+  int fine_start[kCoarseBins];
+  int fine_end[kCoarseBins];
+  
+  for(int y=std::max(start_y-r, 0); y<std::min(start_y+r, height); ++y){
+    for(int x=0; x<width; ++x){
+      int value = in[y*width+x];
+      ++column_coarse[x*kCoarseBins + value/kFineBinsPerCoarse];
+      ++column_fine[x*kFineBins + value];
+    }
+  }
+  
+  for(int y=start_y; y<end_y; ++y){
+    
+    // Slide the column histograms down
+    if(y+r < height){
+      const unsigned char* row = in + (y+r)*width;
+      for(int x=0; x<width; ++x){
+        ++column_coarse[x*kCoarseBins + row[x]/kFineBinsPerCoarse];
+        ++column_fine[x*kFineBins + row[x]];
+      }
+    }
+    if(y > start_y && y-r-1 >= 0){
+      const unsigned char* row = in + (y-r-1)*width;
+      for(int x=0; x<width; ++x){
+        --column_coarse[x*kCoarseBins + row[x]/kFineBinsPerCoarse];
+        --column_fine[x*kFineBins + row[x]];
+      }
+    }
+    
+    int rows = std::min(y+r, height-1) - std::max(y-r, 0) + 1;
+    
+    std::fill(kernel_coarse, kernel_coarse+kCoarseBins, 0);
+    std::fill(kernel_fine, kernel_fine+kFineBins, 0);
+    std::fill(fine_start, fine_start+kCoarseBins, 0);
+    std::fill(fine_end, fine_end+kCoarseBins, 0);
+    
+    // Kernel covers the columns [lo, hi)
+    int lo = 0;
+    int hi = 0;
+    
+    for(int x=0; x<width; ++x){
+      
+      // Slide the coarse kernel histogram right
+      for(; hi<std::min(x+r+1, width); ++hi){
+        const unsigned short* column = &column_coarse[hi*kCoarseBins];
+        for(int b=0; b<kCoarseBins; ++b){
+          kernel_coarse[b] += column[b];
+        }
+      }
+      for(; lo<x-r; ++lo){
+        const unsigned short* column = &column_coarse[lo*kCoarseBins];
+        for(int b=0; b<kCoarseBins; ++b){
+          kernel_coarse[b] -= column[b];
+        }
+      }
+      
+      // Lower median, as in a sorted window
+      int rank = ((hi-lo)*rows-1)/2;
+      
+      int bin = 0;
+      int count = 0;
+      while(count + kernel_coarse[bin] <= rank){
+        count += kernel_coarse[bin];
+        ++bin;
+      }
+      
+      // Bring the fine level of the bin up to date, or rebuild it if cheaper
+      int* fine = kernel_fine + bin*kFineBinsPerCoarse;
+      int offset = bin*kFineBinsPerCoarse;
+      
+      if((hi-fine_end[bin]) + (lo-fine_start[bin]) > hi-lo){
+        std::fill(fine, fine+kFineBinsPerCoarse, 0);
+        fine_start[bin] = lo;
+        fine_end[bin] = lo;
+      }
+      for(int c=fine_end[bin]; c<hi; ++c){
+        const unsigned short* column = &column_fine[c*kFineBins + offset];
+        for(int b=0; b<kFineBinsPerCoarse; ++b){
+          fine[b] += column[b];
+        }
+      }
+      for(int c=fine_start[bin]; c<lo; ++c){
+        const unsigned short* column = &column_fine[c*kFineBins + offset];
+        for(int b=0; b<kFineBinsPerCoarse; ++b){
+          fine[b] -= column[b];
+        }
+      }
+      fine_start[bin] = lo;
+      fine_end[bin] = hi;
+      
+      int value = 0;
+      while(count + fine[value] <= rank){
+        count += fine[value];
+        ++value;
+      }
+      
+      out[y*width+x] = offset + value;
+    }
+  }
+}
+
 //------------------------------------------------------------------------------
   
 Image::Image(){
   data = 0;
+  width = 0;
+  height = 0;
+  capacity = 0;
+  owned = true;
 }
   
 //------------------------------------------------------------------------------
@@ -23,12 +153,50 @@ Image::Image(int w, int h){
   data = new int[w*h];
   width = w;
   height = h;
+  capacity = w*h;
+  owned = true;
+}
+  
+//------------------------------------------------------------------------------
+
+Image::Image(int w, int h, int* pixels){
+  data = pixels;
+  width = w;
+  height = h;
+  capacity = 0;
+  owned = false;
 }
   
 //------------------------------------------------------------------------------
   
 Image::~Image(){
-  delete [] data;
+  if(owned){
+    delete [] data;
+  }
+}
+  
+//------------------------------------------------------------------------------
+  
+void Image::Resize(int w, int h){
+  // Keep the pixel storage when it is large enough
+  if(!owned || w*h > capacity){
+    if(owned){
+      delete [] data;
+    }
+    data = new int[w*h];
+    capacity = w*h;
+    owned = true;
+  }
+  
+  width = w;
+  height = h;
+}
+
+//------------------------------------------------------------------------------
+
+void Image::CopyFrom(const Image& other){
+  Resize(other.width, other.height);
+  memcpy(data, other.data, width*height*sizeof(int));
 }
 
 //------------------------------------------------------------------------------
@@ -131,43 +299,39 @@ Image* Image::GetGradient(){
 
 //------------------------------------------------------------------------------
   
-Image* Image::MedianFilter(int s){
+Image* Image::MedianFilter(int s, ThreadPool* pool){
   Image* filt = new Image(width, height);
-
-	for(int i=0; i<width; ++i){
-		for(int j=0; j<height; ++j){
-
-			std::vector<int> r;
-			std::vector<int> g;
-			std::vector<int> b;
-
-			for(int u=-s/2; u<=s/2; ++u){
-				for(int v=-s/2; v<=s/2; ++v){
-
-					if(!IsInside(i+u, j+v))
-						continue;
-
-					int color = GetGridPixel(i+u, j+v);
-
-					r.push_back(Red(color));
-					g.push_back(Green(color));
-					b.push_back(Blue(color));
-
-				}
-			}
-
-			std::sort(r.begin(), r.end());
-			std::sort(g.begin(), g.end());
-			std::sort(b.begin(), b.end());
-
-			int color = EncodeColour(r[(r.size()-1)/2], g[(g.size()-1)/2], b[(b.size()-1)/2], 255);
-
-			filt->SetGridPixel(i, j, color);
-		}
-	}
-
-	return filt;
-
+  
+  int r = s/2;
+  int size = width*height;
+  
+  // Planar channels
+  std::vector<unsigned char> in(3*size);
+  std::vector<unsigned char> out(3*size);
+  
+  for(int i=0; i<size; ++i){
+    in[i] = Red(data[i]);
+    in[size+i] = Green(data[i]);
+    in[2*size+i] = Blue(data[i]);
+  }
+  
+  // Filter row bands in parallel
+  int n_bands = std::min(pool->Size(), height);
+  
+  pool->ParallelFor(n_bands, [&](int band){
+    int start_y = band*height/n_bands;
+    int end_y = (band+1)*height/n_bands;
+    
+    for(int c=0; c<3; ++c){
+      MedianFilterBand(&in[c*size], &out[c*size], width, height, r, start_y, end_y);
+    }
+  });
+  
+  for(int i=0; i<size; ++i){
+    filt->data[i] = EncodeColour(out[i], out[size+i], out[2*size+i], 255);
+  }
+  
+  return filt;
 }
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+#include "image_buffer.h"
+#include "image.h"
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp{
+  
+//------------------------------------------------------------------------------
+
+Image* WrapImageBuffer(const ImageBuffer& buffer)
+{
+  int one = 1;
+  bool little_endian = *(unsigned char*)&one == 1;
+  
+  if(buffer.format == kPixelBGRA8 && little_endian && buffer.stride == buffer.width*(int)sizeof(int) && (uintptr_t)buffer.data % sizeof(int) == 0){
+    // The layout of EncodeColour, up to alpha which the solver does not read
+    return new Image(buffer.width, buffer.height, (int*)buffer.data);
+  }
+  
+  Image* image = new Image(buffer.width, buffer.height);
+  
+  for(int y=0; y<buffer.height; ++y){
+    const unsigned char* row = buffer.data + y*buffer.stride;
+    int* pixels = image->data + y*buffer.width;
+    
+    switch(buffer.format){
+      case kPixelBGRA8:
+        for(int x=0; x<buffer.width; ++x){
+          pixels[x] = Image::EncodeColour(row[4*x+2], row[4*x+1], row[4*x], 255);
+        }
+        break;
+      case kPixelRGBA8:
+        for(int x=0; x<buffer.width; ++x){
+          pixels[x] = Image::EncodeColour(row[4*x], row[4*x+1], row[4*x+2], 255);
+        }
+        break;
+      case kPixelBGR8:
+        for(int x=0; x<buffer.width; ++x){
+          pixels[x] = Image::EncodeColour(row[3*x+2], row[3*x+1], row[3*x], 255);
+        }
+        break;
+      case kPixelRGB8:
+        for(int x=0; x<buffer.width; ++x){
+          pixels[x] = Image::EncodeColour(row[3*x], row[3*x+1], row[3*x+2], 255);
+        }
+        break;
+      case kPixelGrey8:
+        for(int x=0; x<buffer.width; ++x){
+          pixels[x] = Image::EncodeColour(row[x], row[x], row[x], 255);
+        }
+        break;
+    }
+  }
+  
+  return image;
+}
+  
+//------------------------------------------------------------------------------
+  
+}
+
+//------------------------------------------------------------------------------
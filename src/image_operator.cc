@@ -1,6 +1,9 @@
 #include "image_operator.h"
 #include "image.h"
 #include "graph_particles.h"
+#include "instrumentation.h"
+#include <algorithm>
+#include <cmath>
 
 //------------------------------------------------------------------------------
 
@@ -10,7 +13,26 @@ namespace pmbp {
   
 ImageOperator::ImageOperator(Image** img, Image** grad, Image** filt, int* ww, int* hh, Parameters& params, DisplacementFunction f) :
   images(img), gradients(grad), filtered(filt), w(ww), h(hh), parameters(params), displacement_function(f){
-
+  patch_cache.resize(kPatchCacheSize);
+  Reset();
+}
+  
+//------------------------------------------------------------------------------
+  
+void ImageOperator::Reset(){
+  // Forget what was cached from the previous images, keeping the storage
+  support_order.x = -1;
+  support_order.y = -1;
+  
+  for(int k=0; k<patch_cache.size(); ++k){
+    patch_cache[k].costs.clear();
+  }
+  patch_cache_next = 0;
+  
+  if(parameters.bound_scale > 0.f){
+    integrals[kOne].Build(images[kOne], gradients[kOne]);
+    integrals[kTwo].Build(images[kTwo], gradients[kTwo]);
+  }
 }
   
 //------------------------------------------------------------------------------
@@ -23,6 +45,16 @@ ImageOperator::~ImageOperator(){
   
 float ImageOperator::PatchCost(View view, int x, int y, const State& state, float threshold) const
 {
+  PMBP_COUNT(kPatchCosts);
+  
+  if(parameters.incremental_patch){
+    return IncrementalPatchCost(view, x, y, state, threshold);
+  }
+  
+  if(parameters.ordered_patch){
+    return OrderedPatchCost(view, x, y, state, threshold);
+  }
+  
   float error(0);
   
   View target = view;
@@ -60,18 +92,384 @@ float ImageOperator::PatchCost(View view, int x, int y, const State& state, floa
     // Early termination, must pass unary minus message sum as the message sum
     // will be added to the unary
     if(error > threshold){
+      PMBP_COUNT(kEarlyTerminations);
+      return parameters.infinity;
+    }
+    
+  }
+  
+  return error;
+}
+
+//------------------------------------------------------------------------------
+  
+float ImageOperator::OrderedPatchCost(View view, int x, int y, const State& state, float threshold) const
+{
+  float error(0);
+  
+  View target = view;
+  View source = OtherView(target);
+  
+  const SupportOrder& order = GetSupportOrder(view, x, y);
+  int size = order.weights.size();
+  
+  // Visit the pixels with the highest weights first, so that bad candidates
+  // go over the threshold as early as possible
+  for(int start = 0; start < size; start += kSupportBlock){
+    int end = std::min(start + kSupportBlock, size);
+    
+    for(int k = start; k < end; ++k){
+      float x_target = order.xs[k];
+      float y_target = order.ys[k];
+      
+      float d_x, d_y;
+      displacement_function(x_target, y_target, state, d_x, d_y);
+      
+      // Get source coordinate
+      float x_source = x_target + d_x;
+      float y_source = y_target + d_y;
+      
+      error += WeightedPixelCost(target, source, x_source, y_source, x_target, y_target, order.weights[k]);
+    }
+    
+    // Early termination, checked once per block
+    if(error > threshold){
+      PMBP_COUNT(kEarlyTerminations);
       return parameters.infinity;
     }
+  }
+  
+  return error;
+}
+
+//------------------------------------------------------------------------------
+  
+float ImageOperator::IncrementalPatchCost(View view, int x, int y, const State& state, float threshold) const
+{
+  float error(0);
+  
+  View target = view;
+  View source = OtherView(target);
+  
+  // Patch boundaries
+  int start_x = std::max(x - parameters.patch_size, 0);
+  int start_y = std::max(y - parameters.patch_size, 0);
+  int end_x = std::min(x + parameters.patch_size, w[target]-1);
+  int end_y = std::min(y + parameters.patch_size, h[target]-1);
+  int width = end_x - start_x + 1;
+  int height = end_y - start_y + 1;
+  
+  const std::vector<float>& weights = GetSupportOrder(view, x, y).raster_weights;
+  
+  // Look for the most recent patch evaluated with the same state
+  PatchCache const* previous = 0;
+  
+  for(int k=1; k<=kPatchCacheSize && !previous; ++k){
+    PatchCache const& entry = patch_cache[(patch_cache_next - k + kPatchCacheSize) % kPatchCacheSize];
+    if(!entry.costs.empty() && entry.view == view && entry.state.data == state.data && entry.state.meta == state.meta){
+      previous = &entry;
+    }
+  }
+  
+  patch_costs.resize(width*height);
+  
+  for(int y_target = start_y; y_target <= end_y; ++y_target){
+    for(int x_target = start_x; x_target <= end_x; ++x_target){
+      
+      float cost;
+      int px = x_target - (previous ? previous->start_x : 0);
+      int py = y_target - (previous ? previous->start_y : 0);
+      
+      if(previous && px >= 0 && px < previous->width && py >= 0 && py < previous->height){
+        // Pixel shared with the previous patch
+        cost = previous->costs[py*previous->width+px];
+      }else{
+        float d_x, d_y;
+        displacement_function(x_target, y_target, state, d_x, d_y);
+        
+        // Get source coordinate
+        float x_source = x_target + d_x;
+        float y_source = y_target + d_y;
+        
+        cost = WeightedPixelCost(target, source, x_source, y_source, x_target, y_target, 1.f);
+      }
+      
+      int idx = (y_target-start_y)*width + (x_target-start_x);
+      patch_costs[idx] = cost;
+      error += weights[idx]*cost;
+    }
     
+    // Early termination, the patch is not kept
+    if(error > threshold){
+      PMBP_COUNT(kEarlyTerminations);
+      return parameters.infinity;
+    }
   }
   
+  // Keep the complete patch for the next pixels
+  PatchCache& entry = patch_cache[patch_cache_next];
+  entry.view = view;
+  entry.state = state;
+  entry.start_x = start_x;
+  entry.start_y = start_y;
+  entry.width = width;
+  entry.height = height;
+  entry.costs.swap(patch_costs);
+  patch_cache_next = (patch_cache_next + 1) % kPatchCacheSize;
+  
   return error;
 }
 
 //------------------------------------------------------------------------------
   
+float ImageOperator::RectifiedPatchCost(View view, int x, int y, float a, float b, float c, float threshold) const
+{
+  // Patch cost for rectified images, where the displacement is horizontal and
+  // given by the disparity plane a*x + b*y + c. Source pixels are interpolated
+  // along the rows only.
+  PMBP_COUNT(kPatchCosts);
+  
+  float error(0);
+  
+  View target = view;
+  View source = OtherView(target);
+  
+  // Patch boundaries
+  int start_x = std::max(x - parameters.patch_size, 0);
+  int start_y = std::max(y - parameters.patch_size, 0);
+  int end_x = std::min(x + parameters.patch_size, w[target]-1);
+  int end_y = std::min(y + parameters.patch_size, h[target]-1);
+  int width = end_x - start_x + 1;
+  
+  const std::vector<float>& weights = GetSupportOrder(view, x, y).raster_weights;
+  
+  float maxmatchcosts = (1.f - parameters.alpha) * parameters.tau1 + parameters.alpha * parameters.tau2;
+  float bordercosts = maxmatchcosts * parameters.border;
+  
+  int source_width = w[source];
+  
+  for(int y_target = start_y; y_target <= end_y; ++y_target){
+    
+    const int* target_row = images[target]->data + y_target*w[target];
+    const int* target_gradient_row = gradients[target]->data + y_target*w[target];
+    const int* source_row = images[source]->data + y_target*source_width;
+    const int* source_gradient_row = gradients[source]->data + y_target*source_width;
+    const float* row_weights = &weights[(y_target-start_y)*width];
+    bool row_inside = y_target < h[source];
+    
+    // Disparity along the row, updated incrementally
+    float d = a*start_x + b*y_target + c;
+    
+    for(int x_target = start_x; x_target <= end_x; ++x_target, d += a){
+      
+      float x_source = x_target + d;
+      float w = row_weights[x_target-start_x];
+      
+      if(row_inside && x_source >= 0 && x_source < source_width){
+        
+        // Get target colour and gradient
+        int target_colour = target_row[x_target];
+        float r_t = Image::Red(target_colour);
+        float g_t = Image::Green(target_colour);
+        float b_t = Image::Blue(target_colour);
+        float dr_t = Image::Red(target_gradient_row[x_target]);
+        
+        // Get source colour and gradient, interpolated along the row
+        int left = (int)x_source;
+        int right = std::min(left + 1, source_width-1);
+        float dx = x_source - left;
+        
+        int left_colour = source_row[left];
+        int right_colour = source_row[right];
+        float r_s = float(Image::Red(left_colour))*(1.f-dx) + float(Image::Red(right_colour))*dx;
+        float g_s = float(Image::Green(left_colour))*(1.f-dx) + float(Image::Green(right_colour))*dx;
+        float b_s = float(Image::Blue(left_colour))*(1.f-dx) + float(Image::Blue(right_colour))*dx;
+        float dr_s = float(Image::Red(source_gradient_row[left]))*(1.f-dx) + float(Image::Red(source_gradient_row[right]))*dx;
+        
+        // Difference
+        float diff_colour = (fabs(r_t-r_s)+fabs(g_t-g_s)+fabs(b_t-b_s))/3.f;
+        float diff_gradient = fabs(dr_t-dr_s);
+        
+        diff_colour = std::min(diff_colour, parameters.tau1);
+        diff_gradient = std::min(diff_gradient, parameters.tau2);
+        
+        error += w*((1.f-parameters.alpha)*diff_colour + parameters.alpha*diff_gradient);
+      }else{
+        error += w*(bordercosts);
+      }
+    }
+    PMBP_COUNT_N(kPixelCosts, width);
+    
+    // Early termination
+    if(error > threshold){
+      PMBP_COUNT(kEarlyTerminations);
+      return parameters.infinity;
+    }
+  }
+  
+  return error;
+}
+
+//------------------------------------------------------------------------------
+  
+float ImageOperator::PatchLowerBound(View view, int x, int y, const State& state) const
+{
+  // Estimate of the patch cost from the difference between the means of the
+  // target patch and of the source patch, shifted by the displacement at the
+  // center. Scaled by bound_scale, it is used as a lower bound to reject
+  // candidates before computing their patch cost.
+  
+  View target = view;
+  View source = OtherView(target);
+  
+  // Patch boundaries
+  int start_x = std::max(x - parameters.patch_size, 0);
+  int start_y = std::max(y - parameters.patch_size, 0);
+  int end_x = std::min(x + parameters.patch_size, w[target]-1);
+  int end_y = std::min(y + parameters.patch_size, h[target]-1);
+  
+  float d_x, d_y;
+  displacement_function(x, y, state, d_x, d_y);
+  int shift_x = (int)floor(d_x + 0.5f);
+  int shift_y = (int)floor(d_y + 0.5f);
+  
+  // No bound when the source patch leaves the image
+  if(start_x+shift_x < 0 || end_x+shift_x >= w[source] || start_y+shift_y < 0 || end_y+shift_y >= h[source]){
+    return 0.f;
+  }
+  
+  float n = (end_x-start_x+1)*(end_y-start_y+1);
+  float diff[4];
+  
+  for(int c=0; c<4; ++c){
+    double target_sum = integrals[target].Sum(c, start_x, start_y, end_x, end_y);
+    double source_sum = integrals[source].Sum(c, start_x+shift_x, start_y+shift_y, end_x+shift_x, end_y+shift_y);
+    diff[c] = fabs(target_sum - source_sum)/n;
+  }
+  
+  float diff_colour = std::min((diff[0]+diff[1]+diff[2])/3.f, parameters.tau1);
+  float diff_gradient = std::min(diff[3], parameters.tau2);
+  
+  float weight_sum = GetSupportOrder(view, x, y).weight_sum;
+  
+  return parameters.bound_scale*weight_sum*((1.f-parameters.alpha)*diff_colour + parameters.alpha*diff_gradient);
+}
+
+//------------------------------------------------------------------------------
+  
+void IntegralImage::Build(const Image* image, const Image* gradient)
+{
+  width = image->width;
+  height = image->height;
+  
+  for(int c=0; c<4; ++c){
+    sums[c].assign((width+1)*(height+1), 0.0);
+  }
+  
+  for(int y=0; y<height; ++y){
+    double row[4] = {0.0, 0.0, 0.0, 0.0};
+    
+    for(int x=0; x<width; ++x){
+      int colour = image->GetGridPixel(x, y);
+      row[0] += Image::Red(colour);
+      row[1] += Image::Green(colour);
+      row[2] += Image::Blue(colour);
+      row[3] += Image::Red(gradient->GetGridPixel(x, y));
+      
+      for(int c=0; c<4; ++c){
+        sums[c][(y+1)*(width+1)+x+1] = sums[c][y*(width+1)+x+1] + row[c];
+      }
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+  
+double IntegralImage::Sum(int c, int x0, int y0, int x1, int y1) const
+{
+  const std::vector<double>& s = sums[c];
+  return s[(y1+1)*(width+1)+x1+1] - s[y0*(width+1)+x1+1] - s[(y1+1)*(width+1)+x0] + s[y0*(width+1)+x0];
+}
+
+//------------------------------------------------------------------------------
+  
+const SupportOrder& ImageOperator::GetSupportOrder(View view, int x, int y) const
+{
+  if(support_order.view == view && support_order.x == x && support_order.y == y){
+    return support_order;
+  }
+  
+  // Patch boundaries
+  int start_x = std::max(x - parameters.patch_size, 0);
+  int start_y = std::max(y - parameters.patch_size, 0);
+  int end_x = std::min(x + parameters.patch_size, w[view]-1);
+  int end_y = std::min(y + parameters.patch_size, h[view]-1);
+  
+  // Center color for AWS
+  int center_colour = filtered[view]->GetGridPixel(x, y);
+  float r_center = Image::Red(center_colour);
+  float g_center = Image::Green(center_colour);
+  float b_center = Image::Blue(center_colour);
+  
+  std::vector<int> xs;
+  std::vector<int> ys;
+  std::vector<float> weights;
+  
+  for(int y_target = start_y; y_target <= end_y; ++y_target){
+    for(int x_target = start_x; x_target <= end_x; ++x_target){
+      xs.push_back(x_target);
+      ys.push_back(y_target);
+      weights.push_back(SupportWeight(view, x_target, y_target, r_center, g_center, b_center));
+    }
+  }
+  
+  // Sort by decreasing weight, ties keep the raster order
+  std::vector<int> indices(weights.size());
+  for(int k=0; k<indices.size(); ++k){
+    indices[k] = k;
+  }
+  
+  std::stable_sort(indices.begin(), indices.end(), [&weights](int a, int b){ return weights[a] > weights[b]; });
+  
+  support_order.view = view;
+  support_order.x = x;
+  support_order.y = y;
+  support_order.xs.resize(indices.size());
+  support_order.ys.resize(indices.size());
+  support_order.weights.resize(indices.size());
+  
+  for(int k=0; k<indices.size(); ++k){
+    support_order.xs[k] = xs[indices[k]];
+    support_order.ys[k] = ys[indices[k]];
+    support_order.weights[k] = weights[indices[k]];
+  }
+  
+  support_order.weight_sum = 0.f;
+  for(int k=0; k<weights.size(); ++k){
+    support_order.weight_sum += weights[k];
+  }
+  
+  support_order.raster_weights.swap(weights);
+  
+  return support_order;
+}
+
+//------------------------------------------------------------------------------
+  
 float ImageOperator::PixelCost(View target, View source, float x_source, float y_source, float x_target, float y_target, float r_center, float g_center, float b_center) const
 {
+  // Adaptive support weight
+  float w = SupportWeight(target, x_target, y_target, r_center, g_center, b_center);
+  
+  return WeightedPixelCost(target, source, x_source, y_source, x_target, y_target, w);
+}
+
+//------------------------------------------------------------------------------
+  
+float ImageOperator::WeightedPixelCost(View target, View source, float x_source, float y_source, float x_target, float y_target, float w) const
+{
+  PMBP_COUNT(kPixelCosts);
+  
   float error(0.f);
   
   if(images[source]->IsInside(x_source, y_source)){
@@ -97,13 +495,6 @@ float ImageOperator::PixelCost(View target, View source, float x_source, float y
     float diff_colour = (fabs(float(r_t)-float(r_s))+fabs(float(g_t)-float(g_s))+fabs(float(b_t)-float(b_s)))/3.f;
     float diff_gradient = fabs(float(dr_t)-float(dr_s));
     
-    // Adaptive support weight
-    float filt_r, filt_g, filt_b;
-    filtered[target]->GetInterpolatedPixel(x_target, y_target, filt_r, filt_g, filt_b);
-    
-    float diff_asw = (fabs(r_center-filt_r)+fabs(g_center-filt_g)+fabs(b_center-filt_b));
-    float w = exp(-(diff_asw)/parameters.asw);
-    
     diff_colour = std::min(diff_colour, parameters.tau1);
     diff_gradient = std::min(diff_gradient, parameters.tau2);
     
@@ -114,18 +505,22 @@ float ImageOperator::PixelCost(View target, View source, float x_source, float y
    float maxmatchcosts = (1.f - parameters.alpha) * parameters.tau1 + parameters.alpha * parameters.tau2;
    float bordercosts = maxmatchcosts * parameters.border;
    
-   // Adaptive support weight
-   float filt_r, filt_g, filt_b;
-   filtered[target]->GetInterpolatedPixel(x_target, y_target, filt_r, filt_g, filt_b);
-   
-   float diff_asw = (fabs(r_center-filt_r)+fabs(g_center-filt_g)+fabs(b_center-filt_b));
-   float w = exp(-(diff_asw)/parameters.asw);
-   
    error = w*(bordercosts);
   }
   
   return error;
 }
+
+//------------------------------------------------------------------------------
+  
+float ImageOperator::SupportWeight(View target, float x_target, float y_target, float r_center, float g_center, float b_center) const
+{
+  float filt_r, filt_g, filt_b;
+  filtered[target]->GetInterpolatedPixel(x_target, y_target, filt_r, filt_g, filt_b);
+  
+  float diff_asw = (fabs(r_center-filt_r)+fabs(g_center-filt_g)+fabs(b_center-filt_b));
+  return exp(-(diff_asw)/parameters.asw);
+}
   
 //------------------------------------------------------------------------------
   
@@ -0,0 +1,224 @@
+#include "image_reader_native.h"
+
+#include "image.h"
+#include <png.h>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp{
+  
+//------------------------------------------------------------------------------
+
+namespace{
+
+// Reads the next integer of a PNM header, skipping whitespace and comments
+bool ReadPnmValue(FILE* file, int& value)
+{
+  int c = fgetc(file);
+  
+  while(c != EOF && (isspace(c) || c == '#')){
+    if(c == '#'){
+      while(c != EOF && c != '\n'){
+        c = fgetc(file);
+      }
+    }
+    c = fgetc(file);
+  }
+  
+  if(c == EOF || !isdigit(c)){
+    return false;
+  }
+  
+  value = 0;
+  while(c != EOF && isdigit(c)){
+    value = 10*value + (c - '0');
+    c = fgetc(file);
+  }
+  
+  // A single whitespace character ends the value
+  return c != EOF && isspace(c);
+}
+
+// True if an int holding EncodeColour(r, g, b, a) is stored as b, g, r, a
+bool IsLittleEndian()
+{
+  int one = 1;
+  return *(unsigned char*)&one == 1;
+}
+
+}
+  
+//------------------------------------------------------------------------------
+  
+ImageReaderNative::ImageReaderNative(){
+  
+}
+  
+//------------------------------------------------------------------------------
+
+ImageReaderNative::~ImageReaderNative(){
+  
+}
+  
+//------------------------------------------------------------------------------
+ 
+Image* ImageReaderNative::load(const std::string& filename){
+  FILE* file = fopen(filename.c_str(), "rb");
+  
+  if(!file){
+    return 0;
+  }
+  
+  // Detect the format from the signature
+  unsigned char signature[8] = {0};
+  int n = fread(signature, 1, 8, file);
+  
+  Image* image = 0;
+  
+  if(n == 8 && png_sig_cmp(signature, 0, 8) == 0){
+    image = LoadPng(file);
+  } else if(n >= 3 && signature[0] == 'P' && (signature[1] == '5' || signature[1] == '6') && isspace(signature[2])){
+    fseek(file, 2, SEEK_SET);
+    image = LoadPnm(file, signature[1] == '6');
+  }
+  
+  fclose(file);
+  return image;
+}
+  
+//------------------------------------------------------------------------------
+ 
+Image* ImageReaderNative::LoadPng(FILE* file){
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+  if(!png){
+    return 0;
+  }
+  
+  png_infop info = png_create_info_struct(png);
+  if(!info){
+    png_destroy_read_struct(&png, 0, 0);
+    return 0;
+  }
+  
+  // Set after setjmp and read after a longjmp, hence volatile
+  Image* volatile image = 0;
+  
+  if(setjmp(png_jmpbuf(png))){
+    png_destroy_read_struct(&png, &info, 0);
+    delete image;
+    return 0;
+  }
+  
+  png_init_io(png, file);
+  png_set_sig_bytes(png, 8);
+  png_read_info(png, info);
+  
+  int width = png_get_image_width(png, info);
+  int height = png_get_image_height(png, info);
+  int colour_type = png_get_color_type(png, info);
+  int bit_depth = png_get_bit_depth(png, info);
+  
+  // Expand everything to 8 bit RGB, then add an opaque alpha so that each
+  // decoded row has the memory layout of EncodeColour
+  if(colour_type == PNG_COLOR_TYPE_PALETTE){
+    png_set_palette_to_rgb(png);
+  }
+  if(colour_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8){
+    png_set_expand_gray_1_2_4_to_8(png);
+  }
+  if(bit_depth == 16){
+    png_set_strip_16(png);
+  }
+  if(colour_type & PNG_COLOR_MASK_ALPHA){
+    png_set_strip_alpha(png);
+  }
+  if(colour_type == PNG_COLOR_TYPE_GRAY || colour_type == PNG_COLOR_TYPE_GRAY_ALPHA){
+    png_set_gray_to_rgb(png);
+  }
+  
+  bool little_endian = IsLittleEndian();
+  if(little_endian){
+    png_set_bgr(png);
+    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+  } else {
+    png_set_filler(png, 0xFF, PNG_FILLER_BEFORE);
+  }
+  
+  int n_passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  
+  image = new Image(width, height);
+  
+  for(int pass=0; pass<n_passes; ++pass){
+    for(int y=0; y<height; ++y){
+      png_read_row(png, (png_bytep)(image->data + y*width), 0);
+    }
+  }
+  
+  png_read_end(png, 0);
+  png_destroy_read_struct(&png, &info, 0);
+  
+  return image;
+}
+  
+//------------------------------------------------------------------------------
+ 
+Image* ImageReaderNative::LoadPnm(FILE* file, bool colour){
+  int width, height, max_value;
+  
+  if(!ReadPnmValue(file, width) || !ReadPnmValue(file, height) || !ReadPnmValue(file, max_value)){
+    return 0;
+  }
+  if(width <= 0 || height <= 0 || max_value <= 0 || max_value > 65535){
+    return 0;
+  }
+  
+  int channels = colour ? 3 : 1;
+  int bytes = (max_value > 255) ? 2 : 1;
+  std::vector<unsigned char> row(width*channels*bytes);
+  
+  Image* image = new Image(width, height);
+  
+  for(int y=0; y<height; ++y){
+    if(fread(&row[0], 1, row.size(), file) != row.size()){
+      delete image;
+      return 0;
+    }
+    
+    int* pixels = image->data + y*width;
+    
+    if(bytes == 1 && max_value == 255){
+      if(colour){
+        for(int x=0; x<width; ++x){
+          pixels[x] = Image::EncodeColour(row[3*x], row[3*x+1], row[3*x+2], 255);
+        }
+      } else {
+        for(int x=0; x<width; ++x){
+          pixels[x] = Image::EncodeColour(row[x], row[x], row[x], 255);
+        }
+      }
+    } else {
+      // Rescale other ranges to 8 bit, 16 bit samples being big endian
+      unsigned char c[3];
+      for(int x=0; x<width; ++x){
+        for(int k=0; k<channels; ++k){
+          int i = x*channels + k;
+          int value = (bytes == 2) ? (row[2*i] << 8 | row[2*i+1]) : row[i];
+          c[k] = std::min(value, max_value)*255/max_value;
+        }
+        pixels[x] = colour ? Image::EncodeColour(c[0], c[1], c[2], 255) : Image::EncodeColour(c[0], c[0], c[0], 255);
+      }
+    }
+  }
+  
+  return image;
+}
+  
+//------------------------------------------------------------------------------
+  
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,117 @@
+//------------------------------------------------------------------------------
+
+#include "instrumentation.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+thread_local Instrumentation::Record* Instrumentation::current = 0;
+
+//------------------------------------------------------------------------------
+
+Instrumentation::Record::Record(int iteration, int view) : iteration(iteration), view(view)
+{
+  for(int c=0; c<kNumCounters; ++c){
+    counters[c] = 0;
+  }
+  for(int p=0; p<kNumPhases; ++p){
+    seconds[p] = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+Instrumentation::Instrumentation() : solve(-1)
+{
+}
+
+//------------------------------------------------------------------------------
+
+Instrumentation::~Instrumentation()
+{
+  End();
+}
+
+//------------------------------------------------------------------------------
+
+void Instrumentation::Begin(int iteration, int view)
+{
+  // Records are in a deque, which keeps the current one in place
+  records.push_back(Record(iteration, view));
+  current = &records.back();
+}
+
+//------------------------------------------------------------------------------
+
+void Instrumentation::End()
+{
+  // Only the thread's record of this instance is ended
+  if(!records.empty() && current == &records.back()){
+    current = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void Instrumentation::Clear()
+{
+  End();
+  records.clear();
+}
+
+//------------------------------------------------------------------------------
+
+void Instrumentation::NextSolve()
+{
+  Clear();
+  ++solve;
+}
+
+//------------------------------------------------------------------------------
+
+int Instrumentation::GetSolve() const
+{
+  return solve;
+}
+
+//------------------------------------------------------------------------------
+
+const std::deque<Instrumentation::Record>& Instrumentation::GetRecords() const
+{
+  return records;
+}
+
+//------------------------------------------------------------------------------
+
+void Instrumentation::WriteJson(std::ostream& os) const
+{
+  const char* counter_names[kNumCounters] = {"patch_costs", "pixel_costs", "early_terminations", "accepted_candidates", "message_evaluations"};
+  const char* phase_names[kNumPhases] = {"update_disbelief", "propagate", "randomise", "cache"};
+  
+  os << "{\"solve\": " << solve << ", \"records\": [";
+  for(int r=0; r<records.size(); ++r){
+    const Record& record = records[r];
+    os << (r ? ", " : "") << "{\"iteration\": " << record.iteration << ", \"view\": " << record.view;
+  
+    os << ", \"counters\": {";
+    for(int c=0; c<kNumCounters; ++c){
+      os << (c ? ", " : "") << "\"" << counter_names[c] << "\": " << record.counters[c];
+    }
+  
+    os << "}, \"seconds\": {";
+    for(int p=0; p<kNumPhases; ++p){
+      os << (p ? ", " : "") << "\"" << phase_names[p] << "\": " << record.seconds[p];
+    }
+    os << "}}";
+  }
+  os << "]}\n";
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
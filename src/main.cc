@@ -2,10 +2,20 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <mutex>
+#include <chrono>
+#include <iomanip>
 #include "graph_2d_flow.h"
 #include "graph_stereo.h"
 #include "graph_discrete.h"
+#include "solver.h"
+#include "thread_pool.h"
+#include "pipeline.h"
 #include "image_reader_cimg.h"
+#include "image_reader_native.h"
+#include "visualizer_cimg.h"
+#include "visualizer_file.h"
 #include "utils.h"
 #include "flo_io.h"
 
@@ -13,12 +23,6 @@
 
 using namespace pmbp;
 
-//------------------------------------------------------------------------------
-
-// Static elements
-std::mt19937_64 Random::engine;
-std::uniform_real_distribution<float> Random::uniform;
-std::normal_distribution<float> Random::normal;
 
 //------------------------------------------------------------------------------
 
@@ -38,10 +42,28 @@ Parameters default_stereo_parameters()
   parameters.alpha = 0.9;
   parameters.border = 0.85f;
   parameters.output_disparity_scale = 4.f;
+  parameters.rectified = true;
   parameters.bidirectional = false;
+  parameters.ordered_patch = false;
+  parameters.incremental_patch = false;
+  parameters.bound_scale = 0.f;
+  parameters.compact_storage = false;
+  parameters.node_budget = 0;
+  parameters.band_rows = 16;
+  parameters.n_threads = 0;
+  parameters.verbose = true;
+  parameters.track_energy = false;
+  parameters.warm_start = false;
+  parameters.warm_iterations = 2;
+  parameters.sequence_file = "";
+  parameters.pipeline_depth = 2;
+  parameters.fields_compression = 0;
+  parameters.batch_file = "";
+  parameters.batch_jobs = 1;
   parameters.infinity = 999999.f;
   parameters.output_dir = "";
   parameters.import_file = "";
+  parameters.stats_file = "";
   return parameters;
 }
 
@@ -64,12 +86,35 @@ Parameters default_discrete_parameters()
   parameters.alpha = 0;
   parameters.border = 0.85f;
   parameters.discrete_step = 1;
+  parameters.beam_width = 0;
+  parameters.beam_period = 2;
+  parameters.beam_reference = false;
+  parameters.offset_table = false;
+  parameters.n_levels = 1;
+  parameters.level_iterations = 5;
   parameters.bidirectional = false;
+  parameters.ordered_patch = false;
+  parameters.incremental_patch = false;
+  parameters.bound_scale = 0.f;
+  parameters.compact_storage = false;
+  parameters.node_budget = 0;
+  parameters.band_rows = 16;
+  parameters.n_threads = 0;
+  parameters.verbose = true;
+  parameters.track_energy = true;
+  parameters.warm_start = false;
+  parameters.warm_iterations = 2;
+  parameters.sequence_file = "";
+  parameters.pipeline_depth = 2;
+  parameters.fields_compression = 0;
+  parameters.batch_file = "";
+  parameters.batch_jobs = 1;
   float maxmatchcosts = (1.f - parameters.alpha) * parameters.tau1 + parameters.alpha * parameters.tau2;
   float bordercosts = maxmatchcosts * parameters.border;
   parameters.infinity = parameters.patch_size*parameters.patch_size*bordercosts;
   parameters.output_dir = "";
   parameters.import_file = "";
+  parameters.stats_file = "";
   return parameters;
 }
 
@@ -92,19 +137,29 @@ Parameters default_2dflow_parameters()
   parameters.alpha = 0;
   parameters.border = 0.85f;
   parameters.bidirectional = false;
+  parameters.ordered_patch = false;
+  parameters.incremental_patch = false;
+  parameters.bound_scale = 0.f;
+  parameters.compact_storage = false;
+  parameters.node_budget = 0;
+  parameters.band_rows = 16;
+  parameters.n_threads = 0;
+  parameters.verbose = true;
+  parameters.track_energy = false;
+  parameters.warm_start = false;
+  parameters.warm_iterations = 2;
+  parameters.sequence_file = "";
+  parameters.pipeline_depth = 2;
+  parameters.fields_compression = 0;
+  parameters.batch_file = "";
+  parameters.batch_jobs = 1;
   parameters.infinity = 9999999.f;
   parameters.output_dir = "";
   parameters.import_file = "";
+  parameters.stats_file = "";
   return parameters;
 }
 
-//------------------------------------------------------------------------------
-
-typedef enum{
-  kDiscrete,
-  kStereo,
-  k2DFlow
-} Application;
 
 //------------------------------------------------------------------------------
 
@@ -129,10 +184,33 @@ void display_usage(){
   std::cout << "  -asw asw \t\t Adaptive support weight sigma value" << std::endl;
   std::cout << "  -border b \t\t Border penalty value" << std::endl;
   std::cout << "  -bidir [0|1] \t Enable computation of the forward AND backwards flow" << std::endl;
+  std::cout << "  -ordered_patch [0|1] \t Visit patch pixels by decreasing support weight" << std::endl;
+  std::cout << "  -incremental_patch [0|1] Reuse pixel costs of neighbouring patches with the same state" << std::endl;
+  std::cout << "  -bound_scale s \t Scale of the patch mean lower bound used to reject candidates (s=0 to disable)" << std::endl;
+  std::cout << "  -compact_storage [0|1] Store the message foundations in 16-bit fixed point" << std::endl;
+  std::cout << "  -node_budget mb \t Memory for the nodes of each view, the others being paged to a scratch file (mb=0 to keep all in memory, discrete multi-grid needs mb=0)" << std::endl;
+  std::cout << "  -band_rows r \t Number of rows of the bands paged to the scratch file" << std::endl;
+  std::cout << "  -track_energy [0|1] \t Print the energy of the solution after each iteration" << std::endl;
+  std::cout << "  -n_threads n \t Number of threads of the preprocessing, shared by the jobs of a batch (n=0 for one per core)" << std::endl;
   std::cout << "  -out_dir out \t Directory where results are exported" << std::endl;
   std::cout << "  -import file \t Import previous results from file" << std::endl;
+  std::cout << "  -fields_compression [0|1] Compress the exported fields with zlib" << std::endl;
+  std::cout << "  -stats file \t Write the counters and timers of each iteration as JSON, a line per pair (builds with PMBP_INSTRUMENTATION)" << std::endl;
+  std::cout << "  -batch manifest \t Solve every pair of a manifest (lines of: one two out_dir)" << std::endl;
+  std::cout << "  -batch_jobs j \t Number of pairs solved concurrently in batch mode (j=0 for one per core)" << std::endl;
+  std::cout << "  -sequence list \t Solve the consecutive frames of a list, each pair warm started from the previous one" << std::endl;
+  std::cout << "  -warm_start [0|1] \t Start each pair from the solution of the previous one (sequence mode)" << std::endl;
+  std::cout << "  -warm_iterations nit \t Number of iterations of a warm started pair" << std::endl;
+  std::cout << "  -pipeline_depth d \t Frames queued between the load, preprocess, solve and export stages (sequence and batch modes)" << std::endl;
   std::cout << "  -disp_scale b \t Disparity scale for disparity field display (stereo mode only)" << std::endl;
+  std::cout << "  -rectified [0|1] \t Use the patch cost specialised for horizontal disparities (stereo mode only)" << std::endl;
   std::cout << "  -discrete_step d \t Discretisation value (discrete mode only)" << std::endl;
+  std::cout << "  -beam_width b \t Number of labels kept per node (b=0 to keep all, discrete mode only)" << std::endl;
+  std::cout << "  -beam_period p \t Iterations between beam re-expansions (discrete mode only)" << std::endl;
+  std::cout << "  -beam_reference [0|1] Also run full discrete BP and report the energy gap of the beam (discrete mode only)" << std::endl;
+  std::cout << "  -offset_table [0|1] \t Tabulate the pairwise energy by label offset instead of label pair (discrete mode only)" << std::endl;
+  std::cout << "  -n_levels l \t\t Number of multi-grid levels (l=1 to run on the full grid only, discrete mode only, ignored with -node_budget)" << std::endl;
+  std::cout << "  -level_iterations n \t Number of iterations on each coarse level (discrete mode only)" << std::endl;
   std::cout << std::endl;
   
 }
@@ -167,14 +245,48 @@ void display_parameters(Application app, const Parameters& parameters){
   std::cout << "  asw: \t\t" << parameters.asw << std::endl;
   std::cout << "  border: \t" << parameters.border << std::endl;
   std::cout << "  bidir: \t" << parameters.bidirectional << std::endl;
+  std::cout << "  ordered_patch: " << parameters.ordered_patch << std::endl;
+  std::cout << "  incremental_patch: " << parameters.incremental_patch << std::endl;
+  std::cout << "  bound_scale: \t" << parameters.bound_scale << std::endl;
+  std::cout << "  compact_storage: " << parameters.compact_storage << std::endl;
+  if(parameters.node_budget > 0){
+    std::cout << "  node_budget: \t" << parameters.node_budget << "MB" << std::endl;
+    std::cout << "  band_rows: \t" << parameters.band_rows << std::endl;
+  }
+  std::cout << "  track_energy: \t" << parameters.track_energy << std::endl;
+  std::cout << "  n_threads: \t" << parameters.n_threads << std::endl;
   std::cout << "  out_dir: \t" << parameters.output_dir << std::endl;
   std::cout << "  import_file: \t" << parameters.import_file << std::endl;
+  if(!parameters.stats_file.empty()){
+    std::cout << "  stats_file: \t" << parameters.stats_file << std::endl;
+  }
+  std::cout << "  fields_compression: " << parameters.fields_compression << std::endl;
+  if(!parameters.batch_file.empty()){
+    std::cout << "  batch: \t" << parameters.batch_file << std::endl;
+    std::cout << "  batch_jobs: \t" << parameters.batch_jobs << std::endl;
+    std::cout << "  pipeline_depth: " << parameters.pipeline_depth << std::endl;
+  }
+  if(!parameters.sequence_file.empty()){
+    std::cout << "  sequence: \t" << parameters.sequence_file << std::endl;
+    std::cout << "  warm_start: \t" << parameters.warm_start << std::endl;
+    std::cout << "  warm_iterations: " << parameters.warm_iterations << std::endl;
+    std::cout << "  pipeline_depth: " << parameters.pipeline_depth << std::endl;
+  }
   
-  if(app==kStereo)
+  if(app==kStereo){
     std::cout << "  disp_scale: \t" << parameters.output_disparity_scale<< std::endl;
+    std::cout << "  rectified: \t" << parameters.rectified<< std::endl;
+  }
   
-  if(app==kDiscrete)
+  if(app==kDiscrete){
     std::cout << "  discrete_step:" << parameters.discrete_step<< std::endl;
+    std::cout << "  beam_width: \t" << parameters.beam_width<< std::endl;
+    std::cout << "  beam_period: \t" << parameters.beam_period<< std::endl;
+    std::cout << "  beam_reference: " << parameters.beam_reference<< std::endl;
+    std::cout << "  offset_table: \t" << parameters.offset_table<< std::endl;
+    std::cout << "  n_levels: \t" << parameters.n_levels<< std::endl;
+    std::cout << "  level_iterations: " << parameters.level_iterations<< std::endl;
+  }
   DrawLine();
   
 }
@@ -213,10 +325,33 @@ bool process_args(int argc, char* argv[], Application &application, Parameters&
     else if (std::string(argv[pos]) == "-asw")                    { parameters.asw = atof(argv[++pos]); pos++; }
     else if (std::string(argv[pos]) == "-border")                 { parameters.border = atof(argv[++pos]); pos++; }
     else if (std::string(argv[pos]) == "-bidir")                  { parameters.bidirectional = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-ordered_patch")          { parameters.ordered_patch = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-incremental_patch")      { parameters.incremental_patch = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-bound_scale")            { parameters.bound_scale = atof(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-compact_storage")        { parameters.compact_storage = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-node_budget")            { parameters.node_budget = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-band_rows")              { parameters.band_rows = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-track_energy")           { parameters.track_energy = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-n_threads")              { parameters.n_threads = atoi(argv[++pos]); pos++; }
     else if (std::string(argv[pos]) == "-disp_scale")             { parameters.output_disparity_scale = atof(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-rectified")              { parameters.rectified = atoi(argv[++pos]); pos++; }
     else if (std::string(argv[pos]) == "-discrete_step")          { parameters.discrete_step = atof(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-beam_width")             { parameters.beam_width = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-beam_period")            { parameters.beam_period = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-beam_reference")         { parameters.beam_reference = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-offset_table")           { parameters.offset_table = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-n_levels")               { parameters.n_levels = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-level_iterations")       { parameters.level_iterations = atoi(argv[++pos]); pos++; }
     else if (std::string(argv[pos]) == "-out_dir")                { parameters.output_dir = argv[++pos]; pos++; }
     else if (std::string(argv[pos]) == "-import_file")                { parameters.import_file = argv[++pos]; pos++; }
+    else if (std::string(argv[pos]) == "-stats")                  { parameters.stats_file = argv[++pos]; pos++; }
+    else if (std::string(argv[pos]) == "-fields_compression")     { parameters.fields_compression = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-batch")                  { parameters.batch_file = argv[++pos]; pos++; }
+    else if (std::string(argv[pos]) == "-batch_jobs")             { parameters.batch_jobs = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-sequence")               { parameters.sequence_file = argv[++pos]; parameters.warm_start = true; pos++; }
+    else if (std::string(argv[pos]) == "-warm_start")             { parameters.warm_start = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-warm_iterations")        { parameters.warm_iterations = atoi(argv[++pos]); pos++; }
+    else if (std::string(argv[pos]) == "-pipeline_depth")         { parameters.pipeline_depth = atoi(argv[++pos]); pos++; }
   }
   
   return true;
@@ -224,7 +359,7 @@ bool process_args(int argc, char* argv[], Application &application, Parameters&
 
 //------------------------------------------------------------------------------
 
-void save_results(GraphParticles* graph, const std::string& output_dir)
+void save_results(const PipelineResults& results, const std::string& output_dir, const std::string& prefix = "")
 {
   if(output_dir.empty()){
     return;
@@ -232,17 +367,16 @@ void save_results(GraphParticles* graph, const std::string& output_dir)
   
   // Here add export of the different outputs
   ImageReaderCImg ireader;
+  std::string base = output_dir+"/"+prefix;
 
-  Image motion = graph->OutputMotionField(kOne);
-  ireader.save(&motion, output_dir+"/motion_one.png");
-  
-  Image reconstruction = graph->OutputReconstruction(kOne);
-  ireader.save(&reconstruction, output_dir+"/reconstruction_one.png");
+  ireader.save(const_cast<Image*>(&results.motion), base+"motion_one.png");
+  ireader.save(const_cast<Image*>(&results.reconstruction), base+"reconstruction_one.png");
   
-  Flo* flo = graph->ExportFlo(kOne);
   FloIO flo_io;
-  flo_io.Save(flo, output_dir+"/flow.flo");
-  graph->ExportFields(output_dir+"/state.fields");
+  flo_io.Save(results.flo, base+"flow.flo");
+  
+  std::fstream fs((base+"state.fields").c_str(), std::ios::out | std::ios::binary);
+  fs.write(results.fields.data(), results.fields.size());
 }
 
 //------------------------------------------------------------------------------
@@ -278,27 +412,253 @@ void load(const Parameters& parameters, const std::string& filename)
 
 //------------------------------------------------------------------------------
 
+void inspect(GraphParticles* graph)
+{
+  // Click on the image or the flow to print the node under the mouse
+  Image flow = graph->OutputMotionField(kOne);
+  CImg<unsigned char> cflow = ImageToCImg(flow);
+  
+  CImg<unsigned char> one = ImageToCImg(*graph->GetImage(kOne));
+  CImgDisplay visualisation_one(one, "Inspect - One");
+  CImgDisplay visualisation_flow(cflow, "Inspect - Flow");
+  
+  while (!visualisation_flow.is_closed()) {
+    
+    CImgDisplay::wait_all();
+    
+    if(visualisation_one.button()) {
+      std::cout << graph->Describe(kOne, visualisation_flow.mouse_x(), visualisation_flow.mouse_y());
+    }
+    
+    if(visualisation_flow.button()) {
+      std::cout << graph->Describe(kOne, visualisation_flow.mouse_x(), visualisation_flow.mouse_y());
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+Image* load_image(const std::string& filename){
+  // Decode PNG and PPM/PGM directly, other formats through CImg
+  ImageReaderNative native_reader;
+  Image* image = native_reader.load(filename);
+  
+  if(!image){
+    ImageReaderCImg ireader;
+    image = ireader.load(filename);
+  }
+  
+  return image;
+}
+
+//------------------------------------------------------------------------------
+
+float total_energy(const GraphParticles* graph){
+  float unary_energy, pairwise_energy;
+  graph->OutputUnaryEnergy(kOne, unary_energy);
+  graph->OutputPairwiseEnergy(kOne, pairwise_energy);
+  return unary_energy + pairwise_energy;
+}
+
+//------------------------------------------------------------------------------
+
+void report_beam_gap(const Parameters& parameters, Image* one, Image* two, const GraphParticles* beam){
+  
+  // Full discrete BP on the same pair, with the same number of iterations
+  Parameters full_parameters = parameters;
+  full_parameters.beam_width = 0;
+  full_parameters.verbose = false;
+  full_parameters.stats_file = "";
+  
+  Solver full(full_parameters, kDiscrete);
+  full.Solve(one, two);
+  
+  float beam_energy = total_energy(beam);
+  float full_energy = total_energy(full.GetGraph());
+  
+  DrawLine();
+  std::cout << "Beam energy: " << beam_energy << std::endl;
+  std::cout << "Full BP energy: " << full_energy << std::endl;
+  std::cout << "Energy gap: " << beam_energy - full_energy << " (" << 100.f*(beam_energy - full_energy)/std::max(std::abs(full_energy), 1e-6f) << "%)" << std::endl;
+  DrawLine();
+}
+
+//------------------------------------------------------------------------------
+
 void run(const Parameters& parameters, Application application){
   
-  GraphParticles* graph = 0;
+  Solver solver(parameters, application);
   
-  if(application == kDiscrete){
-    graph = new GraphDiscrete(parameters);
-  } else if (application == kStereo){
-    graph = new GraphStereo(parameters);
-  } else if (application == k2DFlow){
-    graph = new Graph2DFlow(parameters);
+  Image* one = load_image(parameters.one_name);
+  Image* two = load_image(parameters.two_name);
+  
+  // Display the motion field and save it after each iteration
+  VisualizerCImg visu_motion("Motion");
+  VisualizerFile visu_iterations(parameters.output_dir+"/motion_it_");
+  solver.GetGraph()->AddVisualizer(&visu_motion);
+  if(!parameters.output_dir.empty()){
+    solver.GetGraph()->AddVisualizer(&visu_iterations);
   }
   
-  ImageReaderCImg ireader;
-  Image* one = ireader.load(parameters.one_name);
-  Image* two = ireader.load(parameters.two_name);
+  solver.Solve(one, two);
   
-  graph->InitialiseImages(one, two);
-  graph->Solve();
+  if(application == kDiscrete && parameters.beam_width > 0 && parameters.beam_reference){
+    report_beam_gap(parameters, one, two, solver.GetGraph());
+  }
   
   // Save results to a folder
-  save_results(graph, parameters.output_dir);
+  PipelineResults results;
+  results.Collect(solver.GetGraph());
+  save_results(results, parameters.output_dir);
+  
+  delete one;
+  delete two;
+}
+
+//------------------------------------------------------------------------------
+
+void run_batch(const Parameters& parameters, Application application){
+  
+  // Read the manifest, one pair per line: one two out_dir
+  std::vector<std::string> frames;
+  std::vector<PipelineJob> jobs;
+  std::ifstream manifest(parameters.batch_file.c_str());
+  std::string line;
+  
+  while(std::getline(manifest, line)){
+    std::stringstream ss(line);
+    std::string one, two, output_dir;
+    if(line.empty() || line[0] == '#' || !(ss >> one >> two)){
+      continue;
+    }
+    ss >> output_dir;
+    
+    PipelineJob job;
+    job.one = frames.size();
+    job.two = frames.size()+1;
+    job.output_dir = output_dir;
+    frames.push_back(one);
+    frames.push_back(two);
+    jobs.push_back(job);
+  }
+  
+  int n_pairs = jobs.size();
+  
+  // Each job has its own solver and pipeline, whose load stage takes the
+  // next pair from a shared counter, so that jobs stuck on large pairs do
+  // not hold back the others. Pairs are solved by batch_jobs threads, and
+  // all the jobs preprocess on one shared pool of n_threads threads.
+  Parameters job_parameters = parameters;
+  job_parameters.verbose = false;
+  job_parameters.warm_start = false;
+  // Jobs solve concurrently and would all write the same statistics
+  job_parameters.stats_file = "";
+  
+  ThreadPool job_pool(parameters.batch_jobs);
+  ThreadPool pool(parameters.n_threads);
+  std::mutex mutex;
+  int next_pair = 0;
+  int n_solved = 0;
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  
+  job_pool.ParallelFor(job_pool.Size(), [&](int job){
+    Solver solver(job_parameters, application, &pool);
+    Pipeline pipeline(&solver, parameters.pipeline_depth, &pool, load_image, [&](const PipelineJob& pair, const PipelineResults& results){
+      if(results.success){
+        save_results(results, pair.output_dir);
+      }
+      
+      std::lock_guard<std::mutex> lock(mutex);
+      if(results.success){
+        ++n_solved;
+        std::cout << "[" << n_solved << "/" << n_pairs << "] " << frames[pair.one] << " " << frames[pair.two] << std::endl;
+      }else{
+        std::cerr << "Error: could not solve " << frames[pair.one] << " " << frames[pair.two] << std::endl;
+      }
+    });
+    
+    pipeline.SetIndependentPairs(true);
+    pipeline.Run(frames, [&](PipelineJob& pair){
+      std::lock_guard<std::mutex> lock(mutex);
+      if(next_pair == n_pairs){
+        return false;
+      }
+      pair = jobs[next_pair++];
+      return true;
+    });
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cout << "Job " << job << " - ";
+    pipeline.PrintUtilisation();
+  });
+  
+  float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+  
+  DrawLine();
+  std::cout << "Solved " << n_solved << "/" << n_pairs << " pairs in " << seconds << "s (" << n_solved/std::max(seconds, 1e-6f) << " pairs/s, " << job_pool.Size() << " jobs, " << pool.Size() << " preprocessing threads)" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+
+void run_sequence(const Parameters& parameters, Application application){
+  
+  // Read the frames, one per line
+  std::vector<std::string> frames;
+  std::ifstream list(parameters.sequence_file.c_str());
+  std::string line;
+  
+  while(std::getline(list, line)){
+    std::stringstream ss(line);
+    std::string frame;
+    if(line.empty() || line[0] == '#' || !(ss >> frame)){
+      continue;
+    }
+    frames.push_back(frame);
+  }
+  
+  if(frames.size() < 2){
+    std::cerr << "Error: a sequence needs at least two frames" << std::endl;
+    return;
+  }
+  
+  // Consecutive pairs, all saved in out_dir with the index of the pair as
+  // prefix
+  std::vector<PipelineJob> jobs;
+  for(int i=0; i+1<frames.size(); ++i){
+    std::stringstream prefix;
+    prefix << std::setw(4) << std::setfill('0') << i << "_";
+    
+    PipelineJob job;
+    job.one = i;
+    job.two = i+1;
+    job.output_dir = parameters.output_dir;
+    job.prefix = prefix.str();
+    jobs.push_back(job);
+  }
+  
+  // A single solver keeps the fields of the previous pair to start the next,
+  // and shares its threads with the preprocessing stage
+  ThreadPool pool(parameters.n_threads);
+  Solver solver(parameters, application, &pool);
+  
+  VisualizerCImg visu_motion("Motion");
+  solver.GetGraph()->AddVisualizer(&visu_motion);
+  
+  Pipeline pipeline(&solver, parameters.pipeline_depth, &pool, load_image, [&](const PipelineJob& pair, const PipelineResults& results){
+    if(!results.success){
+      std::cerr << "Error: could not solve " << frames[pair.one] << " " << frames[pair.two] << std::endl;
+      return;
+    }
+    
+    save_results(results, pair.output_dir, pair.prefix);
+    std::cout << "[" << pair.two << "/" << jobs.size() << "] " << frames[pair.one] << " " << frames[pair.two] << ": " << results.solve_seconds << "s" << std::endl;
+  });
+  
+  pipeline.Run(frames, jobs);
+  
+  DrawLine();
+  pipeline.PrintUtilisation();
 }
 
 //------------------------------------------------------------------------------
@@ -312,7 +672,14 @@ int main(int argc, char* argv[])
   
   if(success){
     display_parameters(application, parameters);
-    run(parameters, application);
+    
+    if(!parameters.batch_file.empty()){
+      run_batch(parameters, application);
+    }else if(!parameters.sequence_file.empty()){
+      run_sequence(parameters, application);
+    }else{
+      run(parameters, application);
+    }
   }
   
   return EXIT_SUCCESS;
@@ -0,0 +1,116 @@
+//------------------------------------------------------------------------------
+
+#include "mapped_file.h"
+#include <fstream>
+#include <iterator>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+MappedFile::MappedFile()
+{
+  data = 0;
+  size = 0;
+}
+
+//------------------------------------------------------------------------------
+
+MappedFile::~MappedFile()
+{
+  Close();
+}
+
+//------------------------------------------------------------------------------
+
+bool MappedFile::Open(const std::string& filename)
+{
+  Close();
+  
+#ifdef _WIN32
+  std::ifstream fs(filename.c_str(), std::ios::in | std::ios::binary);
+  if(!fs){
+    return false;
+  }
+  
+  buffer.assign(std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>());
+  data = buffer.empty() ? 0 : &buffer[0];
+  size = buffer.size();
+  return data != 0;
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0){
+    return false;
+  }
+  
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    close(fd);
+    return false;
+  }
+  
+  // The mapping stays valid once the descriptor is closed
+  void* address = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  
+  if(address == MAP_FAILED){
+    return false;
+  }
+  
+  data = (const char*)address;
+  size = st.st_size;
+  return true;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+  std::vector<char>().swap(buffer);
+#else
+  if(data){
+    munmap((void*)data, size);
+  }
+#endif
+  
+  data = 0;
+  size = 0;
+}
+
+//------------------------------------------------------------------------------
+
+bool MappedFile::IsOpen() const
+{
+  return data != 0;
+}
+
+//------------------------------------------------------------------------------
+
+const char* MappedFile::Data() const
+{
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+size_t MappedFile::Size() const
+{
+  return size;
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
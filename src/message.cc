@@ -43,6 +43,13 @@ float Message::GetValue(int k) const
   return values[k];
 }
   
+//------------------------------------------------------------------------------
+  
+const float* Message::GetData() const
+{
+  return &values[0];
+}
+  
 //------------------------------------------------------------------------------
 
 void Message::SetUniform()
@@ -74,6 +81,20 @@ void Message::Normalize()
   
 //------------------------------------------------------------------------------
   
+size_t Message::Size() const
+{
+  return values.size();
+}
+  
+//------------------------------------------------------------------------------
+  
+size_t Message::Bytes() const
+{
+  return values.capacity()*sizeof(float);
+}
+  
+//------------------------------------------------------------------------------
+  
 std::string Message::Summary() const
 {
   std::stringstream summary;
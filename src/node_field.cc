@@ -0,0 +1,326 @@
+//------------------------------------------------------------------------------
+
+#include "node_field.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+// 64-bit offsets, the scratch file of a large field exceeding 2GB
+bool Seek(std::FILE* file, long long offset)
+{
+#ifdef _WIN32
+  return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+  return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+}
+
+//------------------------------------------------------------------------------
+
+NodeField::NodeField()
+  : width(0), height(0), band_rows(0), max_bands(0), file(0), file_size(0), band_reads(0), band_writes(0)
+{
+}
+
+//------------------------------------------------------------------------------
+
+NodeField::NodeField(const NodeField& other)
+  : width(0), height(0), band_rows(0), max_bands(0), file(0), file_size(0), band_reads(0), band_writes(0)
+{
+  *this = other;
+}
+
+//------------------------------------------------------------------------------
+
+NodeField::~NodeField()
+{
+  Clear();
+}
+
+//------------------------------------------------------------------------------
+
+NodeField& NodeField::operator=(const NodeField& other)
+{
+  if(this == &other){
+    return *this;
+  }
+  
+  Clear();
+  
+  if(!other.band_rows){
+    width = other.width;
+    height = other.height;
+    rows = other.rows;
+    return *this;
+  }
+  
+  // A copy of a paged field is paged the same way, and filled band by band
+  if(!Page(other.band_rows, other.max_bands)){
+    throw std::runtime_error("could not create the scratch file of a node field");
+  }
+  Resize(other.width, other.height);
+  
+  for(int j=0; j<height; ++j){
+    for(int i=0; i<width; ++i){
+      *Get(i, j) = *other.Get(i, j);
+    }
+  }
+  
+  return *this;
+}
+
+//------------------------------------------------------------------------------
+
+void NodeField::Resize(int w, int h)
+{
+  // The nodes of a paged field are all reset, and only created when their
+  // band is first accessed
+  if(band_rows){
+    width = w;
+    height = h;
+    rows.assign(h, std::vector<Node>());
+  
+    int n_bands = (h+band_rows-1)/band_rows;
+    resident.clear();
+    band_offsets.assign(n_bands, -1);
+    band_sizes.assign(n_bands, 0);
+    band_capacities.assign(n_bands, 0);
+    file_size = 0;
+    return;
+  }
+  
+  // Otherwise the nodes keep their storage if the size does not change
+  if(w == width && h == height){
+    return;
+  }
+  
+  width = w;
+  height = h;
+  rows.assign(h, std::vector<Node>(w));
+}
+
+//------------------------------------------------------------------------------
+
+void NodeField::Swap(NodeField& other)
+{
+  std::swap(width, other.width);
+  std::swap(height, other.height);
+  rows.swap(other.rows);
+  std::swap(band_rows, other.band_rows);
+  std::swap(max_bands, other.max_bands);
+  std::swap(file, other.file);
+  resident.swap(other.resident);
+  band_offsets.swap(other.band_offsets);
+  band_sizes.swap(other.band_sizes);
+  band_capacities.swap(other.band_capacities);
+  std::swap(file_size, other.file_size);
+  std::swap(band_reads, other.band_reads);
+  std::swap(band_writes, other.band_writes);
+}
+
+//------------------------------------------------------------------------------
+
+bool NodeField::Page(int rows_per_band, int bands)
+{
+  // Back in memory
+  if(rows_per_band <= 0){
+    if(!band_rows){
+      return true;
+    }
+  
+    max_bands = band_offsets.size();
+    for(int j=0; j<height; ++j){
+      if(rows[j].empty()){
+        FaultIn(j);
+      }
+    }
+  
+    std::fclose(file);
+    file = 0;
+    band_rows = 0;
+    max_bands = 0;
+    resident.clear();
+    band_offsets.clear();
+    band_sizes.clear();
+    band_capacities.clear();
+    file_size = 0;
+    return true;
+  }
+  
+  bands = std::max(bands, 3);
+  
+  if(band_rows && band_rows != rows_per_band){
+    Page(0, 0);
+  }
+  
+  if(!band_rows){
+    file = std::tmpfile();
+    if(!file){
+      return false;
+    }
+  
+    band_rows = rows_per_band;
+    int n_bands = (height+band_rows-1)/band_rows;
+    resident.clear();
+    band_offsets.assign(n_bands, -1);
+    band_sizes.assign(n_bands, 0);
+    band_capacities.assign(n_bands, 0);
+    file_size = 0;
+  
+    // Write out the rows held in memory
+    for(int b=0; b<n_bands; ++b){
+      if(!rows[b*band_rows].empty()){
+        Evict(b);
+      }
+    }
+  }
+  
+  max_bands = bands;
+  while(resident.size() > max_bands){
+    Evict(resident.front());
+    resident.erase(resident.begin());
+  }
+  
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool NodeField::IsPaged() const
+{
+  return band_rows > 0;
+}
+
+//------------------------------------------------------------------------------
+
+long NodeField::GetBandReads() const
+{
+  return band_reads;
+}
+
+//------------------------------------------------------------------------------
+
+long NodeField::GetBandWrites() const
+{
+  return band_writes;
+}
+
+//------------------------------------------------------------------------------
+
+void NodeField::FaultIn(int row) const
+{
+  if(!band_rows){
+    return;
+  }
+  
+  int band = row/band_rows;
+  
+  // Make room by writing out the band farthest from this one, which is the
+  // one a sweep has left behind
+  if(resident.size() >= max_bands){
+    int farthest = 0;
+    for(int r=1; r<resident.size(); ++r){
+      if(abs(resident[r]-band) > abs(resident[farthest]-band)){
+        farthest = r;
+      }
+    }
+    Evict(resident[farthest]);
+    resident.erase(resident.begin()+farthest);
+  }
+  
+  int first = band*band_rows;
+  int last = std::min(first+band_rows, height);
+  
+  if(band_offsets[band] < 0 || band_sizes[band] == 0){
+    for(int j=first; j<last; ++j){
+      rows[j].resize(width);
+    }
+  }else{
+    std::vector<char> buffer(band_sizes[band]);
+    if(!Seek(file, band_offsets[band]) || std::fread(&buffer[0], 1, buffer.size(), file) != buffer.size()){
+      throw std::runtime_error("could not read a band of nodes from the scratch file");
+    }
+  
+    const char* data = &buffer[0];
+    for(int j=first; j<last; ++j){
+      rows[j].resize(width);
+      for(int i=0; i<width; ++i){
+        data = rows[j][i].Unpack(data);
+      }
+    }
+    ++band_reads;
+  }
+  
+  resident.push_back(band);
+}
+
+//------------------------------------------------------------------------------
+
+void NodeField::Evict(int band) const
+{
+  int first = band*band_rows;
+  int last = std::min(first+band_rows, height);
+  
+  std::vector<char> buffer;
+  for(int j=first; j<last; ++j){
+    for(int i=0; i<width; ++i){
+      rows[j][i].Pack(buffer);
+    }
+    std::vector<Node>().swap(rows[j]);
+  }
+  
+  // Bands keep their place in the file unless they grew
+  if(band_offsets[band] < 0 || buffer.size() > band_capacities[band]){
+    band_offsets[band] = file_size;
+    band_capacities[band] = buffer.size();
+    file_size += buffer.size();
+  }
+  band_sizes[band] = buffer.size();
+  
+  if(buffer.empty()){
+    return;
+  }
+  
+  if(!Seek(file, band_offsets[band]) || std::fwrite(&buffer[0], 1, buffer.size(), file) != buffer.size()){
+    throw std::runtime_error("could not write a band of nodes to the scratch file");
+  }
+  ++band_writes;
+}
+
+//------------------------------------------------------------------------------
+
+void NodeField::Clear()
+{
+  if(file){
+    std::fclose(file);
+  }
+  file = 0;
+  width = 0;
+  height = 0;
+  rows.clear();
+  band_rows = 0;
+  max_bands = 0;
+  resident.clear();
+  band_offsets.clear();
+  band_sizes.clear();
+  band_capacities.clear();
+  file_size = 0;
+  band_reads = 0;
+  band_writes = 0;
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
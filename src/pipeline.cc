@@ -0,0 +1,290 @@
+//------------------------------------------------------------------------------
+
+#include "pipeline.h"
+#include "solver.h"
+#include "graph_particles.h"
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <limits>
+#include <iostream>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+typedef std::chrono::steady_clock SteadyClock;
+
+float SecondsSince(SteadyClock::time_point start)
+{
+  return std::chrono::duration<float>(SteadyClock::now() - start).count();
+}
+
+// A frame moving through the load and preprocess stages
+struct PipelineFrame{
+  int index;
+  PreparedImage* prepared;
+};
+
+// Results of a job moving to the export stage
+struct PipelineOutput{
+  PipelineJob job;
+  PipelineResults* results;
+};
+
+}
+
+//------------------------------------------------------------------------------
+
+void PipelineResults::Collect(GraphParticles* graph)
+{
+  motion.CopyFrom(graph->OutputMotionField(kOne));
+  reconstruction.CopyFrom(graph->OutputReconstruction(kOne));
+  
+  delete flo;
+  flo = graph->ExportFlo(kOne);
+  
+  std::stringstream ss;
+  graph->ExportFields(ss);
+  fields = ss.str();
+}
+
+//------------------------------------------------------------------------------
+
+Pipeline::Pipeline(Solver* solver, int depth, ThreadPool* pool, LoadFunction load, ExportFunction save)
+  : solver(solver), depth(std::max(depth, 1)), load(load), save(save), independent_pairs(false), preprocessor(pool)
+{
+  for(int s=0; s<kNumStages; ++s){
+    busy_seconds[s] = 0;
+  }
+  wall_seconds = 0;
+  n_jobs = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void Pipeline::Run(const std::vector<std::string>& frames, const std::vector<PipelineJob>& jobs)
+{
+  int next = 0;
+  Run(frames, [&](PipelineJob& job){
+    if(next == jobs.size()){
+      return false;
+    }
+    job = jobs[next++];
+    return true;
+  });
+}
+
+//------------------------------------------------------------------------------
+
+void Pipeline::Run(const std::vector<std::string>& frames, JobSource next_job)
+{
+  for(int s=0; s<kNumStages; ++s){
+    busy_seconds[s] = 0;
+  }
+  n_jobs = 0;
+  
+  BoundedQueue<PipelineFrame> loaded(depth);
+  BoundedQueue<PipelineFrame> prepared(depth);
+  BoundedQueue<PipelineOutput> solved(depth);
+  
+  // Jobs in order, for the solve stage. Never full, as the frame queues
+  // hold the load stage back.
+  BoundedQueue<PipelineJob> pulled(std::numeric_limits<int>::max());
+  
+  // Pulled jobs not yet solved using each frame, a frame being released when
+  // its count drops to 0
+  std::map<int, int> uses;
+  std::mutex uses_mutex;
+  
+  SteadyClock::time_point run_start = SteadyClock::now();
+  
+  // Decode the frames
+  std::thread load_thread([&](){
+    // Counts the uses of a job, returning the frames it has to load
+    auto pull = [&](PipelineJob& job, std::vector<int>& to_load){
+      if(!next_job(job)){
+        return false;
+      }
+      std::lock_guard<std::mutex> lock(uses_mutex);
+      to_load.clear();
+      int pair[2] = {job.one, job.two};
+      for(int v=0; v<(job.one == job.two ? 1 : 2); ++v){
+        if(uses[pair[v]]++ == 0){
+          to_load.push_back(pair[v]);
+        }
+      }
+      return true;
+    };
+  
+    // The next job is pulled before the frames of the current one are
+    // pushed, hence before the current one can be solved and release them
+    PipelineJob job, next;
+    std::vector<int> to_load, next_to_load;
+    bool has_next = pull(next, next_to_load);
+  
+    while(has_next){
+      job = next;
+      to_load.swap(next_to_load);
+      has_next = pull(next, next_to_load);
+      pulled.Push(job);
+  
+      for(int i=0; i<to_load.size(); ++i){
+        SteadyClock::time_point start = SteadyClock::now();
+  
+        PipelineFrame frame;
+        frame.index = to_load[i];
+        frame.prepared = new PreparedImage();
+        try{
+          frame.prepared->image = load(frames[to_load[i]]);
+        }catch(...){
+          frame.prepared->image = 0;
+        }
+  
+        busy_seconds[kLoad] += SecondsSince(start);
+        loaded.Push(frame);
+      }
+    }
+    pulled.Close();
+    loaded.Close();
+  });
+  
+  // Compute their derived images
+  std::thread preprocess_thread([&](){
+    PipelineFrame frame;
+    while(loaded.Pop(frame)){
+      SteadyClock::time_point start = SteadyClock::now();
+  
+      if(frame.prepared->image){
+        preprocessor.Prepare(frame.prepared, 3);
+      }
+  
+      busy_seconds[kPreprocess] += SecondsSince(start);
+      prepared.Push(frame);
+    }
+    prepared.Close();
+  });
+  
+  // Write the outputs
+  std::thread export_thread([&](){
+    PipelineOutput output;
+    while(solved.Pop(output)){
+      SteadyClock::time_point start = SteadyClock::now();
+  
+      try{
+        save(output.job, *output.results);
+      }catch(...){
+        std::cerr << "Error: could not export " << frames[output.job.one] << " " << frames[output.job.two] << std::endl;
+      }
+      delete output.results;
+  
+      busy_seconds[kExport] += SecondsSince(start);
+    }
+  });
+  
+  // Solve on the calling thread, as the solver is not shared
+  std::map<int, PreparedImage*> live;
+  PipelineJob job;
+  
+  while(pulled.Pop(job)){
+    PipelineFrame frame;
+    while((!live.count(job.one) || !live.count(job.two)) && prepared.Pop(frame)){
+      live[frame.index] = frame.prepared;
+    }
+  
+    SteadyClock::time_point start = SteadyClock::now();
+  
+    PipelineResults* results = new PipelineResults();
+    PreparedImage* one = live[job.one];
+    PreparedImage* two = live[job.two];
+  
+    if(one && one->image && two && two->image){
+      try{
+        // Same random sequence as a single run on the pair
+        if(independent_pairs){
+          Random::Reset();
+        }
+        solver->Solve(*one, *two);
+        results->solve_seconds = SecondsSince(start);
+        results->Collect(solver->GetGraph());
+        results->success = true;
+      }catch(...){
+        results->success = false;
+      }
+    }
+  
+    // Release the frames no pulled job uses any more
+    {
+      std::lock_guard<std::mutex> lock(uses_mutex);
+      int pair[2] = {job.one, job.two};
+      for(int v=0; v<(job.one == job.two ? 1 : 2); ++v){
+        if(--uses[pair[v]] == 0){
+          uses.erase(pair[v]);
+          if(live[pair[v]]){
+            delete live[pair[v]]->image;
+            delete live[pair[v]];
+          }
+          live.erase(pair[v]);
+        }
+      }
+    }
+  
+    busy_seconds[kSolve] += SecondsSince(start);
+    ++n_jobs;
+  
+    PipelineOutput output = {job, results};
+    solved.Push(output);
+  }
+  solved.Close();
+  
+  load_thread.join();
+  preprocess_thread.join();
+  export_thread.join();
+  
+  wall_seconds = SecondsSince(run_start);
+}
+
+//------------------------------------------------------------------------------
+
+void Pipeline::SetIndependentPairs(bool independent)
+{
+  independent_pairs = independent;
+}
+
+//------------------------------------------------------------------------------
+
+float Pipeline::GetBusySeconds(Stage stage) const
+{
+  return busy_seconds[stage];
+}
+
+//------------------------------------------------------------------------------
+
+float Pipeline::GetWallSeconds() const
+{
+  return wall_seconds;
+}
+
+//------------------------------------------------------------------------------
+
+void Pipeline::PrintUtilisation() const
+{
+  const char* names[kNumStages] = {"load", "preprocess", "solve", "export"};
+  
+  std::cout << "Pipeline: " << n_jobs << " pairs in " << wall_seconds << "s, busy time per stage:" << std::endl;
+  for(int s=0; s<kNumStages; ++s){
+    std::cout << "  " << names[s] << ": \t" << busy_seconds[s] << "s (" << int(100*busy_seconds[s]/std::max(wall_seconds, 1e-6f)) << "%)" << std::endl;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,161 @@
+//------------------------------------------------------------------------------
+
+#include "preprocessor.h"
+#include "image.h"
+#include "thread_pool.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PMBP_SSE2
+#include <emmintrin.h>
+#endif
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+namespace{
+
+// Gradient magnitude at x, as computed by Image::GetGradient
+inline
+int GradientPixel(const unsigned char* row, const unsigned char* top, const unsigned char* bottom, int width, int x)
+{
+  int left = row[(x != 0) ? x-1 : x];
+  int right = row[(x != width-1) ? x+1 : x];
+  float dx = right - left;
+  float dy = (int)bottom[x] - (int)top[x];
+  int value = std::min((int)std::sqrt(dx*dx+dy*dy), 255);
+  return Image::EncodeColour(value, value, value, 255);
+}
+
+#ifdef PMBP_SSE2
+// Widens 4 grey values to 32 bit integers
+inline
+__m128i LoadGrey(const unsigned char* p)
+{
+  int packed;
+  memcpy(&packed, p, sizeof(int));
+  __m128i zero = _mm_setzero_si128();
+  return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+}
+#endif
+
+}
+
+//------------------------------------------------------------------------------
+
+Preprocessor::Preprocessor(ThreadPool* p) : pool(p)
+{
+  
+}
+
+//------------------------------------------------------------------------------
+
+void Preprocessor::Process(const Image* image, int median_size, Image* gradient, Image* filtered)
+{
+  int width = image->width;
+  int height = image->height;
+  int size = width*height;
+  
+  gradient->Resize(width, height);
+  filtered->Resize(width, height);
+  
+  // Planar channels and grey
+  in.resize(3*size);
+  out.resize(3*size);
+  grey.resize(size);
+  
+  int n_bands = std::min(pool->Size(), height);
+  
+  pool->ParallelFor(n_bands, [&](int band){
+    int start = band*height/n_bands*width;
+    int end = (band+1)*height/n_bands*width;
+    
+    const int* data = image->data;
+    unsigned char* red = &in[0];
+    unsigned char* green = &in[size];
+    unsigned char* blue = &in[2*size];
+    
+    // Same truncation as Image::Grey, written so that it vectorises
+    for(int i=start; i<end; ++i){
+      int r = (data[i] >> 16) & 0xFF;
+      int g = (data[i] >> 8) & 0xFF;
+      int b = data[i] & 0xFF;
+      red[i] = r;
+      green[i] = g;
+      blue[i] = b;
+      grey[i] = (r+g+b)/3;
+    }
+  });
+  
+  // Gradient and median, which read the neighbouring bands
+  pool->ParallelFor(n_bands, [&](int band){
+    int start_y = band*height/n_bands;
+    int end_y = (band+1)*height/n_bands;
+    
+    for(int y=start_y; y<end_y; ++y){
+      GradientRow(&grey[0], width, height, y, gradient->data + y*width);
+    }
+    
+    for(int c=0; c<3; ++c){
+      Image::MedianFilterBand(&in[c*size], &out[c*size], width, height, median_size/2, start_y, end_y);
+    }
+    
+    for(int i=start_y*width; i<end_y*width; ++i){
+      filtered->data[i] = Image::EncodeColour(out[i], out[size+i], out[2*size+i], 255);
+    }
+  });
+}
+
+//------------------------------------------------------------------------------
+
+void Preprocessor::Prepare(PreparedImage* prepared, int median_size)
+{
+  Process(prepared->image, median_size, &prepared->gradient, &prepared->filtered);
+}
+
+//------------------------------------------------------------------------------
+
+void Preprocessor::GradientRow(const unsigned char* grey, int width, int height, int y, int* out) const
+{
+  // Central differences, repeating the center pixel at the borders
+  const unsigned char* row = grey + y*width;
+  const unsigned char* top = (y != 0) ? row - width : row;
+  const unsigned char* bottom = (y != height-1) ? row + width : row;
+  
+  out[0] = GradientPixel(row, top, bottom, width, 0);
+  int x = 1;
+  
+#ifdef PMBP_SSE2
+  // Interior pixels, 4 at a time
+  const __m128i max_magnitude = _mm_set1_epi32(255);
+  const __m128i alpha = _mm_set1_epi32(0xFF000000);
+  
+  for(; x+4<width; x+=4){
+    __m128 dx = _mm_cvtepi32_ps(_mm_sub_epi32(LoadGrey(row+x+1), LoadGrey(row+x-1)));
+    __m128 dy = _mm_cvtepi32_ps(_mm_sub_epi32(LoadGrey(bottom+x), LoadGrey(top+x)));
+    __m128 magnitude = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    
+    // Truncate and clamp to 255
+    __m128i value = _mm_cvttps_epi32(magnitude);
+    __m128i over = _mm_cmpgt_epi32(value, max_magnitude);
+    value = _mm_or_si128(_mm_and_si128(over, max_magnitude), _mm_andnot_si128(over, value));
+    
+    __m128i colour = _mm_or_si128(alpha, _mm_or_si128(value, _mm_or_si128(_mm_slli_epi32(value, 8), _mm_slli_epi32(value, 16))));
+    _mm_storeu_si128((__m128i*)(out+x), colour);
+  }
+#endif
+  
+  for(; x<width; ++x){
+    out[x] = GradientPixel(row, top, bottom, width, x);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+}
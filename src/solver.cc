@@ -0,0 +1,73 @@
+//------------------------------------------------------------------------------
+
+#include "solver.h"
+#include "graph_discrete.h"
+#include "graph_stereo.h"
+#include "graph_2d_flow.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+Solver::Solver(const Parameters& parameters, Application application, ThreadPool* pool)
+{
+  graph = 0;
+  
+  if(application == kDiscrete){
+    graph = new GraphDiscrete(parameters);
+  } else if (application == kStereo){
+    graph = new GraphStereo(parameters);
+  } else if (application == k2DFlow){
+    graph = new Graph2DFlow(parameters);
+  }
+  
+  if(pool){
+    graph->SetThreadPool(pool);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+Solver::~Solver()
+{
+  delete graph;
+}
+
+//------------------------------------------------------------------------------
+
+void Solver::Solve(Image* one, Image* two)
+{
+  graph->InitialiseImages(one, two);
+  graph->Solve();
+}
+
+//------------------------------------------------------------------------------
+
+void Solver::Solve(const ImageBuffer& one, const ImageBuffer& two)
+{
+  graph->InitialiseImages(one, two);
+  graph->Solve();
+}
+
+//------------------------------------------------------------------------------
+
+void Solver::Solve(const PreparedImage& one, const PreparedImage& two)
+{
+  graph->InitialiseImages(one, two);
+  graph->Solve();
+}
+
+//------------------------------------------------------------------------------
+
+GraphParticles* Solver::GetGraph() const
+{
+  return graph;
+}
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
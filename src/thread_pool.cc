@@ -0,0 +1,112 @@
+//------------------------------------------------------------------------------
+
+#include "thread_pool.h"
+#include <algorithm>
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+ThreadPool::ThreadPool(int n_threads)
+{
+  if(n_threads <= 0){
+    n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+  }
+  
+  task = 0;
+  n_tasks = 0;
+  next_task = 0;
+  pending_tasks = 0;
+  generation = 0;
+  stop = false;
+  
+  for(int i=1; i<n_threads; ++i){
+    workers.push_back(std::thread(&ThreadPool::Work, this));
+  }
+}
+
+//------------------------------------------------------------------------------
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  
+  for(int i=0; i<workers.size(); ++i){
+    workers[i].join();
+  }
+}
+
+//------------------------------------------------------------------------------
+
+int ThreadPool::Size() const
+{
+  return workers.size() + 1;
+}
+
+//------------------------------------------------------------------------------
+
+void ThreadPool::ParallelFor(int n, const std::function<void(int)>& f)
+{
+  std::lock_guard<std::mutex> loop(loop_mutex);
+  std::unique_lock<std::mutex> lock(mutex);
+  task = &f;
+  n_tasks = n;
+  next_task = 0;
+  pending_tasks = n;
+  ++generation;
+  wake.notify_all();
+  
+  RunTasks(lock);
+  
+  while(pending_tasks > 0){
+    done.wait(lock);
+  }
+  task = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void ThreadPool::Work()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  long seen = 0;
+  
+  while(true){
+    while(!stop && generation == seen){
+      wake.wait(lock);
+    }
+    if(stop){
+      return;
+    }
+    seen = generation;
+    RunTasks(lock);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void ThreadPool::RunTasks(std::unique_lock<std::mutex>& lock)
+{
+  while(next_task < n_tasks){
+    int i = next_task++;
+    const std::function<void(int)>& f = *task;
+    
+    lock.unlock();
+    f(i);
+    lock.lock();
+    
+    if(--pending_tasks == 0){
+      done.notify_all();
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+}
@@ -0,0 +1,20 @@
+//------------------------------------------------------------------------------
+
+#include "utils.h"
+
+//------------------------------------------------------------------------------
+
+namespace pmbp {
+
+//------------------------------------------------------------------------------
+
+// Static elements
+thread_local std::mt19937_64 Random::engine;
+thread_local std::uniform_real_distribution<float> Random::uniform;
+thread_local std::normal_distribution<float> Random::normal;
+
+//------------------------------------------------------------------------------
+
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,690 @@
+//------------------------------------------------------------------------------
+
+// Checks of properties the optimised code paths must keep. Each test is run
+// by name, "test_pmbp <name>", and returns a non-zero status on failure.
+
+//------------------------------------------------------------------------------
+
+#include "graph_2d_flow.h"
+#include "graph_discrete.h"
+#include "image.h"
+#include "min_convolution.h"
+#include "node.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+//------------------------------------------------------------------------------
+
+using namespace pmbp;
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+// Reports a failed check, which fails the test
+bool Check(bool condition, const std::string& message)
+{
+  if(!condition){
+    std::cerr << "FAILED: " << message << std::endl;
+  }
+  return condition;
+}
+
+//------------------------------------------------------------------------------
+
+// 2D flow parameters small enough for a test to run in a second
+Parameters TestParameters()
+{
+  Parameters parameters;
+  parameters.n_iterations = 2;
+  parameters.patch_size = 2;
+  parameters.max_motion = 0;
+  parameters.n_particles = 3;
+  parameters.weight_pw = 0.001f;
+  parameters.truncate_pw = 50;
+  parameters.tau1 = 20;
+  parameters.tau2 = 20;
+  parameters.alpha = 0;
+  parameters.asw = 15;
+  parameters.border = 0.85f;
+  parameters.output_disparity_scale = 4;
+  parameters.discrete_step = 1;
+  parameters.beam_width = 0;
+  parameters.beam_period = 2;
+  parameters.beam_reference = false;
+  parameters.offset_table = false;
+  parameters.n_levels = 1;
+  parameters.level_iterations = 5;
+  parameters.bidirectional = false;
+  parameters.ordered_patch = false;
+  parameters.incremental_patch = false;
+  parameters.rectified = false;
+  parameters.bound_scale = 0.f;
+  parameters.compact_storage = false;
+  parameters.node_budget = 0;
+  parameters.band_rows = 16;
+  parameters.n_threads = 0;
+  parameters.verbose = false;
+  parameters.track_energy = false;
+  parameters.warm_start = false;
+  parameters.warm_iterations = 2;
+  parameters.pipeline_depth = 2;
+  parameters.fields_compression = 0;
+  parameters.batch_jobs = 1;
+  parameters.infinity = 9999999.f;
+  return parameters;
+}
+
+//------------------------------------------------------------------------------
+
+// Smooth random texture, shifted by (dx, dy)
+Image* TextureImage(int w, int h, int dx, int dy)
+{
+  Image* image = new Image(w, h);
+  for(int j=0; j<h; ++j){
+    for(int i=0; i<w; ++i){
+      int x = i-dx;
+      int y = j-dy;
+      unsigned char r = (unsigned char)(127 + 60*sin(0.31f*x) + 60*cos(0.23f*y));
+      unsigned char g = (unsigned char)(127 + 90*sin(0.17f*x + 0.29f*y));
+      unsigned char b = (unsigned char)((x*37 + y*91) & 0xFF);
+      image->SetGridPixel(i, j, Image::EncodeColour(r, g, b, 255));
+    }
+  }
+  return image;
+}
+
+//------------------------------------------------------------------------------
+
+// Gives access to the patch costs and nodes of a 2D flow graph
+class TestFlow : public Graph2DFlow{
+ public:
+  TestFlow(const Parameters& p) : Graph2DFlow(p) {}
+  
+  State RandomState(View view, int x, int y) const{
+    State state(data_dim, meta_dim);
+    GetRandomState(view, x, y, state);
+    return state;
+  }
+  
+  // Patch cost with the given traversal, the default one if neither is set
+  float PatchCost(View view, int x, int y, const State& state, float threshold, bool ordered, bool incremental){
+    parameters.ordered_patch = ordered;
+    parameters.incremental_patch = incremental;
+    return image_operator->PatchCost(view, x, y, state, threshold);
+  }
+  
+  void SetCompression(int compression){
+    parameters.fields_compression = compression;
+  }
+  
+  const NodeField& GetNodes(View view) const{
+    return nodes[view];
+  }
+  
+  // Particles of all the nodes of both views, row by row
+  std::vector<float> GetAllParticles(){
+    FaultInAll();
+  
+    int particle_size = parameters.n_particles*(data_dim+meta_dim);
+    std::vector<float> particles;
+    std::vector<float> node_particles(particle_size);
+  
+    for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+      for(int j=0; j<h[view]; ++j){
+        for(int i=0; i<w[view]; ++i){
+          GetParticles(nodes[view].Get(i, j), &node_particles[0]);
+          particles.insert(particles.end(), node_particles.begin(), node_particles.end());
+        }
+      }
+    }
+    return particles;
+  }
+  
+  // Writes the original unversioned layout: tag, state dimensions, size and
+  // number of particles, then the particles column by column, the size
+  // being repeated before the second view
+  void ExportLegacyFields(const std::string& filename){
+    FaultInAll();
+  
+    std::ofstream fs(filename.c_str(), std::ios::binary);
+    char tag = GetTag();
+    fs.write(&tag, 1);
+    fs.write((char*)&data_dim, sizeof(data_dim));
+    fs.write((char*)&meta_dim, sizeof(meta_dim));
+  
+    int particle_size = parameters.n_particles*(data_dim+meta_dim);
+    std::vector<float> node_particles(particle_size);
+  
+    for(int view=kOne; view<=(parameters.bidirectional ? kTwo : kOne); ++view){
+      fs.write((char*)&w[view], sizeof(int));
+      fs.write((char*)&h[view], sizeof(int));
+      if(view == kOne){
+        fs.write((char*)&parameters.n_particles, sizeof(int));
+      }
+  
+      for(int i=0; i<w[view]; ++i){
+        for(int j=0; j<h[view]; ++j){
+          GetParticles(nodes[view].Get(i, j), &node_particles[0]);
+          fs.write((char*)&node_particles[0], particle_size*sizeof(float));
+        }
+      }
+    }
+  }
+};
+
+//------------------------------------------------------------------------------
+
+// Exports the particles of a solved bidirectional graph, zlib compressed,
+// uncompressed or in the legacy layout (compression -1), and checks that a
+// new graph imports them back
+bool FieldsRoundTrip(const std::string& filename, int compression)
+{
+  Image* one = TextureImage(48, 32, 0, 0);
+  Image* two = TextureImage(48, 32, 2, 1);
+  
+  Parameters parameters = TestParameters();
+  parameters.bidirectional = true;
+  parameters.n_iterations = 1;
+  
+  TestFlow solved(parameters);
+  solved.InitialiseImages(one, two);
+  Random::Reset();
+  solved.Solve();
+  
+  if(compression < 0){
+    solved.ExportLegacyFields(filename);
+  }else{
+    solved.SetCompression(compression);
+    solved.ExportFields(filename);
+  }
+  
+  TestFlow imported(parameters);
+  imported.InitialiseImages(one, two);
+  imported.ImportFields(filename);
+  bool ok = Check(imported.GetAllParticles() == solved.GetAllParticles(), "particles imported from " + filename);
+  
+  std::remove(filename.c_str());
+  delete one;
+  delete two;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// The weight-ordered patch cost is the default one summed in another order,
+// and terminates early exactly when the default one would go over the
+// threshold, the pixel costs being positive
+bool TestOrderedPatch()
+{
+  Image* one = TextureImage(40, 30, 0, 0);
+  Image* two = TextureImage(40, 30, 2, 1);
+  
+  TestFlow graph(TestParameters());
+  graph.InitialiseImages(one, two);
+  
+  const float infinity = TestParameters().infinity;
+  const float no_threshold = std::numeric_limits<float>::max();
+  std::mt19937 rng(4);
+  bool ok = true;
+  
+  for(int t=0; t<500 && ok; ++t){
+    int x = rng()%40;
+    int y = rng()%30;
+    State state = graph.RandomState(kOne, x, y);
+  
+    float cost = graph.PatchCost(kOne, x, y, state, no_threshold, false, false);
+    float ordered = graph.PatchCost(kOne, x, y, state, no_threshold, true, false);
+    ok = Check(std::abs(ordered-cost) <= 1e-4f*std::max(cost, 1.f), "ordered patch cost");
+  
+    float above = graph.PatchCost(kOne, x, y, state, 1.01f*cost + 1e-3f, true, false);
+    ok = ok && Check(std::abs(above-cost) <= 1e-4f*std::max(cost, 1.f), "ordered patch cost under the threshold");
+  
+    if(cost > 1.f){
+      ok = ok && Check(graph.PatchCost(kOne, x, y, state, 0.99f*cost, true, false) == infinity, "ordered patch cost over the threshold");
+    }
+  }
+  
+  delete one;
+  delete two;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// The heap and the cached argmin give the particles a linear scan would,
+// ties going to the lowest index
+bool TestHeap()
+{
+  std::mt19937 rng(2);
+  bool ok = true;
+  
+  for(int t=0; t<200 && ok; ++t){
+    int n = 1 + rng()%12;
+    Node node(n);
+    for(int k=0; k<n; ++k){
+      node.SetParticleValue(k, 0.f);
+    }
+  
+    for(int u=0; u<50 && ok; ++u){
+      // Few distinct values, hence many ties
+      node.SetParticleValue(rng()%n, float(rng()%4));
+  
+      int min_idx = 0;
+      int max_idx = 0;
+      for(int k=1; k<n; ++k){
+        if(node.GetDisbelief(k) < node.GetDisbelief(min_idx)){
+          min_idx = k;
+        }
+        if(node.GetDisbelief(k) > node.GetDisbelief(max_idx)){
+          max_idx = k;
+        }
+      }
+  
+      ok = Check(node.GetMinValueParticleIdx() == min_idx, "argmin of the node") && Check(node.GetMaxValueParticleIdx() == max_idx, "argmax of the node");
+    }
+  }
+  
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// The vectorised min-sum gives the minimum of a scalar loop, at every length
+// around the 8-wide blocks
+bool TestMinSum()
+{
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> uniform(-100.f, 100.f);
+  bool ok = true;
+  
+  for(int n=0; n<=40 && ok; ++n){
+    for(int t=0; t<20 && ok; ++t){
+      std::vector<float> a(n+1);
+      std::vector<float> b(n+1);
+      for(int i=0; i<=n; ++i){
+        a[i] = uniform(rng);
+        b[i] = uniform(rng);
+      }
+  
+      // Every other array unaligned
+      const float* a_first = &a[t%2];
+      const float* b_first = &b[t%2];
+      float expected = infinity;
+      for(int i=0; i<n; ++i){
+        expected = std::min(expected, a_first[i] + b_first[i]);
+      }
+  
+      ok = Check(MinSum(a_first, b_first, n) == expected, "min-sum of " + std::to_string(n) + " values");
+    }
+  }
+  
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// The offset table gives the messages of the dense table it replaces, and
+// so the same discrete solution
+bool TestOffsetTable()
+{
+  std::mt19937 rng(6);
+  std::uniform_real_distribution<float> uniform(0.f, 50.f);
+  bool ok = true;
+  
+  for(int t=0; t<50 && ok; ++t){
+    int n_u = 1 + rng()%7;
+    int n_v = 1 + rng()%7;
+    int n = n_u*n_v;
+    int table_side = 2*n_u-1;
+  
+    std::vector<float> table(table_side*(2*n_v-1));
+    std::vector<float> foundation(n);
+    for(int i=0; i<table.size(); ++i){
+      table[i] = uniform(rng);
+    }
+    for(int s=0; s<n; ++s){
+      foundation[s] = uniform(rng);
+    }
+  
+    // Dense table of the same energies, indexed by target and source labels
+    std::vector<float> dense(n*n);
+    for(int target=0; target<n; ++target){
+      for(int source=0; source<n; ++source){
+        int du = source%n_u - target%n_u;
+        int dv = source/n_u - target/n_u;
+        dense[target*n+source] = table[(dv+n_v-1)*table_side + du+n_u-1];
+      }
+    }
+  
+    std::vector<float> messages(n);
+    std::vector<float> offset_messages(n);
+    MinConvolution(&dense[0], &foundation[0], n, n, &messages[0]);
+    OffsetMinConvolution(&table[0], &foundation[0], n_u, n_v, &offset_messages[0]);
+    ok = Check(messages == offset_messages, "messages from the offset table");
+  }
+  
+  // Both tables on a small discrete problem
+  Image* one = TextureImage(16, 12, 0, 0);
+  Image* two = TextureImage(16, 12, 2, 1);
+  
+  Parameters parameters = TestParameters();
+  parameters.max_motion = 3;
+  parameters.patch_size = 1;
+  parameters.weight_pw = 0.1f;
+  parameters.n_particles = 1;
+  float energies[2][2];
+  
+  for(int offset=0; offset<2; ++offset){
+    parameters.offset_table = offset;
+    GraphDiscrete graph(parameters);
+    graph.InitialiseImages(one, two);
+    Random::Reset();
+    graph.Solve();
+    graph.OutputUnaryEnergy(kOne, energies[offset][0]);
+    graph.OutputPairwiseEnergy(kOne, energies[offset][1]);
+  }
+  ok = ok && Check(energies[0][0] == energies[1][0] && energies[0][1] == energies[1][1], "energies with the offset table");
+  
+  delete one;
+  delete two;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// The incremental patch cost reuses the pixel costs of neighbouring patches
+// evaluated with the same state, and gives the default cost bit for bit
+bool TestIncrementalPatch()
+{
+  Image* one = TextureImage(40, 30, 0, 0);
+  Image* two = TextureImage(40, 30, 2, 1);
+  
+  TestFlow graph(TestParameters());
+  graph.InitialiseImages(one, two);
+  
+  const float infinity = TestParameters().infinity;
+  const float no_threshold = std::numeric_limits<float>::max();
+  std::mt19937 rng(7);
+  bool ok = true;
+  
+  for(int t=0; t<100 && ok; ++t){
+    State state = graph.RandomState(kOne, rng()%40, rng()%30);
+  
+    // A run of pixels with the same state, as propagation along a row or
+    // column evaluates them, so that most of each patch is reused
+    bool along_row = t%2;
+    int x = rng()%40;
+    int y = rng()%30;
+    int length = 1 + rng()%8;
+  
+    for(int k=0; k<length && ok; ++k){
+      int xk = along_row ? std::min(x+k, 39) : x;
+      int yk = along_row ? y : std::min(y+k, 29);
+  
+      float cost = graph.PatchCost(kOne, xk, yk, state, no_threshold, false, false);
+      float incremental = graph.PatchCost(kOne, xk, yk, state, no_threshold, false, true);
+      ok = Check(incremental == cost, "incremental patch cost");
+  
+      if(cost > 1.f){
+        ok = ok && Check(graph.PatchCost(kOne, xk, yk, state, 0.99f*cost, false, true) == infinity, "incremental patch cost over the threshold");
+      }
+    }
+  }
+  
+  delete one;
+  delete two;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// Median filter by sorting the window, as before the histogram filter
+Image* SortingMedianFilter(const Image* image, int s)
+{
+  Image* filtered = new Image(image->width, image->height);
+  
+  for(int i=0; i<image->width; ++i){
+    for(int j=0; j<image->height; ++j){
+      std::vector<int> r, g, b;
+      for(int u=-s/2; u<=s/2; ++u){
+        for(int v=-s/2; v<=s/2; ++v){
+          if(!image->IsInside(i+u, j+v)){
+            continue;
+          }
+          int colour = image->GetGridPixel(i+u, j+v);
+          r.push_back(Image::Red(colour));
+          g.push_back(Image::Green(colour));
+          b.push_back(Image::Blue(colour));
+        }
+      }
+      std::sort(r.begin(), r.end());
+      std::sort(g.begin(), g.end());
+      std::sort(b.begin(), b.end());
+      int m = (r.size()-1)/2;
+      filtered->SetGridPixel(i, j, Image::EncodeColour(r[m], g[m], b[m], 255));
+    }
+  }
+  
+  return filtered;
+}
+
+//------------------------------------------------------------------------------
+
+// The histogram median filter gives the same pixels as the sorting one
+bool TestMedian()
+{
+  ThreadPool pool(2);
+  std::mt19937 rng(1);
+  bool ok = true;
+  
+  for(int t=0; t<100 && ok; ++t){
+    int w = 1 + rng()%40;
+    int h = 1 + rng()%40;
+    int s = 1 + rng()%15;
+  
+    // Noise, and every other image few distinct values to exercise ties
+    Image image(w, h);
+    for(int i=0; i<w*h; ++i){
+      image.data[i] = t%2 ? Image::EncodeColour(rng()%4*60, rng()%3, rng()%256, 255) : int(rng() | 0xFF000000);
+    }
+  
+    Image* expected = SortingMedianFilter(&image, s);
+    Image* filtered = image.MedianFilter(s, &pool);
+    ok = Check(std::equal(expected->data, expected->data+w*h, filtered->data), "median filter of size " + std::to_string(s));
+    delete expected;
+    delete filtered;
+  }
+  
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// Compressed fields files, and files of the original layout, give back the
+// exported particles of both views
+bool TestFields()
+{
+  return FieldsRoundTrip("test_fields_zlib.pmbf", 1) && FieldsRoundTrip("test_fields_legacy.pmbf", -1);
+}
+
+//------------------------------------------------------------------------------
+
+// Uncompressed fields files are mapped and their rows copied on demand,
+// giving back the exported particles once all of them are faulted in
+bool TestMappedFields()
+{
+  return FieldsRoundTrip("test_fields_mapped.pmbf", 0);
+}
+
+//------------------------------------------------------------------------------
+
+// Compact foundations give the messages of float ones when the pairwise
+// energies are within the range, the values saturated above it included.
+// Values on the 16-bit steps are kept exactly, so the messages match bit for
+// bit and only the saturation could change them.
+bool TestCompact()
+{
+  const int n = 32;
+  const float step = 0.25f;
+  const float range = 65535*step;
+  std::mt19937 rng(3);
+  bool ok = true;
+  
+  std::vector<float> table(n*n);
+  std::vector<float> foundation(n);
+  std::vector<float> buffer(n);
+  std::vector<float> messages(n);
+  std::vector<float> compact_messages(n);
+  
+  for(int t=0; t<100 && ok; ++t){
+    for(int i=0; i<n*n; ++i){
+      table[i] = (rng()%65536)*step;
+    }
+  
+    // A third of the values far above the range, which saturate
+    for(int k=0; k<n; ++k){
+      foundation[k] = (rng()%3 == 0) ? 3*range + (rng()%1000)*step : (rng()%4000)*step;
+    }
+  
+    Node node(n);
+    Node compact(n);
+    compact.UseCompactFoundations(range);
+    node.InitialiseFoundation();
+    compact.InitialiseFoundation();
+    node.SetFoundation(kLeft, &foundation[0]);
+    compact.SetFoundation(kLeft, &foundation[0]);
+  
+    MinConvolution(&table[0], node.GetFoundationData(kLeft, &buffer[0]), n, n, &messages[0]);
+    MinConvolution(&table[0], compact.GetFoundationData(kLeft, &buffer[0]), n, n, &compact_messages[0]);
+    ok = Check(messages == compact_messages, "messages from compact foundations");
+  }
+  
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// Paging the nodes gives bit-identical results
+bool TestPaging()
+{
+  Image* one = TextureImage(96, 64, 0, 0);
+  Image* two = TextureImage(96, 64, 2, 1);
+  
+  Parameters parameters = TestParameters();
+  Parameters paged_parameters = parameters;
+  paged_parameters.node_budget = 1;
+  paged_parameters.band_rows = 2;
+  
+  TestFlow graph(parameters);
+  graph.InitialiseImages(one, two);
+  Random::Reset();
+  graph.Solve();
+  
+  TestFlow paged(paged_parameters);
+  paged.InitialiseImages(one, two);
+  Random::Reset();
+  paged.Solve();
+  
+  bool ok = Check(paged.GetNodes(kOne).IsPaged() && paged.GetNodes(kOne).GetBandReads() > 0, "nodes paged");
+  
+  float unary, pairwise, paged_unary, paged_pairwise;
+  graph.OutputUnaryEnergy(kOne, unary);
+  graph.OutputPairwiseEnergy(kOne, pairwise);
+  paged.OutputUnaryEnergy(kOne, paged_unary);
+  paged.OutputPairwiseEnergy(kOne, paged_pairwise);
+  ok = ok && Check(unary == paged_unary && pairwise == paged_pairwise, "energies with paging");
+  
+  Image motion = graph.OutputMotionField(kOne);
+  Image paged_motion = paged.OutputMotionField(kOne);
+  ok = ok && Check(std::equal(motion.data, motion.data+motion.width*motion.height, paged_motion.data), "motion field with paging");
+  ok = ok && Check(graph.GetAllParticles() == paged.GetAllParticles(), "particles with paging");
+  
+  delete one;
+  delete two;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// Files of the original layout, stored by columns, fill a paged field band
+// by band. Past the initialisation of the field, which writes each band
+// once, the import reads and writes each band once more.
+bool TestPagedLegacyFields()
+{
+  Image* one = TextureImage(96, 64, 0, 0);
+  Image* two = TextureImage(96, 64, 2, 1);
+  
+  Parameters parameters = TestParameters();
+  parameters.n_iterations = 1;
+  
+  TestFlow solved(parameters);
+  solved.InitialiseImages(one, two);
+  Random::Reset();
+  solved.Solve();
+  solved.ExportLegacyFields("test_fields_paged_legacy.pmbf");
+  
+  Parameters paged_parameters = parameters;
+  paged_parameters.node_budget = 1;
+  paged_parameters.band_rows = 2;
+  
+  TestFlow imported(paged_parameters);
+  imported.InitialiseImages(one, two);
+  imported.ImportFields("test_fields_paged_legacy.pmbf");
+  
+  const NodeField& nodes = imported.GetNodes(kOne);
+  bool ok = Check(nodes.IsPaged(), "nodes paged");
+  int n_bands = 64/2;
+  ok = ok && Check(nodes.GetBandReads() <= n_bands && nodes.GetBandWrites() <= 2*n_bands, "bands read and written by the import");
+  ok = ok && Check(imported.GetAllParticles() == solved.GetAllParticles(), "particles imported into a paged field");
+  
+  std::remove("test_fields_paged_legacy.pmbf");
+  delete one;
+  delete two;
+  return ok;
+}
+
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  std::map<std::string, std::function<bool()> > tests;
+  tests["ordered_patch"] = TestOrderedPatch;
+  tests["heap"] = TestHeap;
+  tests["min_sum"] = TestMinSum;
+  tests["offset_table"] = TestOffsetTable;
+  tests["incremental_patch"] = TestIncrementalPatch;
+  tests["median"] = TestMedian;
+  tests["fields"] = TestFields;
+  tests["mapped_fields"] = TestMappedFields;
+  tests["compact"] = TestCompact;
+  tests["paging"] = TestPaging;
+  tests["paged_legacy_fields"] = TestPagedLegacyFields;
+  
+  if(argc != 2 || !tests.count(argv[1])){
+    std::cerr << "Usage: test_pmbp name, with name one of:";
+    for(std::map<std::string, std::function<bool()> >::const_iterator it=tests.begin(); it!=tests.end(); ++it){
+      std::cerr << " " << it->first;
+    }
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+  }
+  
+  return tests[argv[1]]() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//------------------------------------------------------------------------------